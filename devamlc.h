@@ -166,8 +166,8 @@ AMLC status word (from AMLCT5):
 /* macro to setup the next AMLC poll */
 
 #define AMLC_SET_POLL \
-  if (devpoll[device] == 0 || devpoll[device] > AMLCPOLL*gv.instpermsec/pollspeedup) \
-    devpoll[device] = AMLCPOLL*gv.instpermsec/pollspeedup;  /* setup another poll */
+  if (getdevpoll(device) == 0 || getdevpoll(device) > AMLCPOLL*gv.instpermsec/pollspeedup) \
+    setdevpoll(device, AMLCPOLL*gv.instpermsec/pollspeedup);  /* setup another poll */
 
 
 int devamlc (int class, int func, int device) {
@@ -1300,7 +1300,7 @@ dorecv:
 	gv.intvec = dc[dx].intvector;
 	dc[dx].interrupting = 1;
       } else
-	devpoll[device] = 100;         /* come back soon! */
+	setdevpoll(device, 100);       /* come back soon! */
     }
 
     /* the largest DMQ buffer size is 1023 chars.  If any line's DMQ
@@ -1329,5 +1329,29 @@ dorecv:
     AMLC_SET_POLL;
     break;
   }
+
+  case -3:
+  case -4:
+
+    /* only Primos' view of the board is saved; lines come back
+       disconnected and are reconnected as usual */
+
+    SNAPVAR(class, wascti);
+    SNAPVAR(class, anyeor);
+    SNAPVAR(class, pollspeedup);
+    SNAPVAR(class, dc[dx].dmcchan);
+    SNAPVAR(class, dc[dx].baseaddr);
+    SNAPVAR(class, dc[dx].intvector);
+    SNAPVAR(class, dc[dx].intenable);
+    SNAPVAR(class, dc[dx].interrupting);
+    SNAPVAR(class, dc[dx].xmitenabled);
+    SNAPVAR(class, dc[dx].recvenabled);
+    SNAPVAR(class, dc[dx].ctinterrupt);
+    SNAPVAR(class, dc[dx].dsstime);
+    SNAPVAR(class, dc[dx].lconf);
+    SNAPVAR(class, dc[dx].recvlx);
+    SNAPVAR(class, dc[dx].bufnum);
+    SNAPVAR(class, dc[dx].eor);
+    return 0;
   }
 }
@@ -313,15 +313,14 @@ typedef struct {
 } t_dma;
 static t_dma rcv, xmit;
 
-static int sawsigio=0, olddevpoll;
+static int sawsigio=0;
 
 static double tv0ts;
 
 void pnchavedata(int s) {
   if (sawsigio) return;
-  olddevpoll = devpoll[7];
-  devpoll[7] = 1;
   sawsigio = 1;
+  devpollasync(7);
 }
 
 #define HEXNIBBLE(ch) (0 <= (ch) && (ch) <= 9)? (ch) + '0': (ch) - 10 + 'a'
@@ -616,11 +615,22 @@ void pncinitdma(t_dma *iob, char *iotype) {
   if ((*iob).dmanw > MAXPNCWORDS)
     (*iob).dmanw = MAXPNCWORDS;      /* clamp it */
   (*iob).dmaaddr = ((getar16(REGDMX16 + ((*iob).dmareg)) & 3)<<16) | getar16(REGDMX16 + ((*iob).dmareg+1));
-  TRACE(T_RIO, " pncinitdma: %s dmachan=%o, dmareg=%o, [dmaregs]=%o|%o, dmaaddr=%o/%o, dmanw=%d\n", iotype, (*iob).dmachan, (*iob).dmareg, swap16(regs.sym.regdmx[(*iob).dmareg]), swap16(regs.sym.regdmx[(*iob).dmareg+1]), (*iob).dmaaddr>>16, (*iob).dmaaddr&0xFFFF, (*iob).dmanw);
+  TRACE(T_RIO, " pncinitdma: %s dmachan=%o, dmareg=%o, [dmaregs]=%o|%o, dmaaddr=%o/%o, dmanw=%d\n", iotype, (*iob).dmachan, (*iob).dmareg, getar16(REGDMX16 + (*iob).dmareg), getar16(REGDMX16 + (*iob).dmareg+1), (*iob).dmaaddr>>16, (*iob).dmaaddr&0xFFFF, (*iob).dmanw);
   (*iob).memp = MEM + mapio((*iob).dmaaddr);
   (*iob).state = PNCBSRDY;
 }
 
+/* save or restore a dma transfer for -snapshot; memp points into MEM */
+
+void pncsnapdma(int class, t_dma *iob) {
+  int memx;
+
+  memx = ((*iob).memp != NULL) ? (*iob).memp - MEM : -1;
+  snapio(class, iob, offsetof(t_dma, memp));
+  SNAPVAR(class, memx);
+  (*iob).memp = (memx >= 0) ? MEM + memx : NULL;
+}
+
 /* transmit to a node.  If the node is disabled, fail.  If not yet
    connected, initiate a connect.  If connecting, try to authenticate.
    If authenticated, transmit */
@@ -649,6 +659,7 @@ unsigned short pncxmit1(short nodeid) {
   if (nodeid == myid) {
     if (rcv.state == PNCBSRDY && rcv.dmanw >= xmit.dmanw) {
       TRACE(T_INST|T_RIO, " xmit: loopback, rcv.memp=%o/%o\n", ((int)(rcv.memp))>>16, ((int)(rcv.memp))&0xFFFF);
+      pdcinvrange(rcv.memp-MEM, xmit.dmanw);
       memcpy(rcv.memp, xmit.memp, xmit.dmanw*2);
       putar16(REGDMX16 + rcv.dmareg, getar16(REGDMX16 + rcv.dmareg) + (xmit.dmanw<<4));  /* bump recv count */
       putar16(REGDMX16 + rcv.dmareg+1, getar16(REGDMX16 + rcv.dmareg+1) + xmit.dmanw); /* and address */
@@ -827,6 +838,7 @@ int pncrecv1(int nodeid) {
   
   ni[nodeid].rcvpkt[2] = myid;
   ni[nodeid].rcvpkt[3] = nodeid;    
+  pdcinvrange(rcv.memp-MEM, nw);
   memcpy(rcv.memp, ni[nodeid].rcvpkt+2, nw*2);
   putar16(REGDMX16 + rcv.dmareg, getar16(REGDMX16 + rcv.dmareg) + (nw<<4));  /* bump recv count */
   putar16(REGDMX16 + rcv.dmareg+1, getar16(REGDMX16 + rcv.dmareg+1) + nw); /* and address */
@@ -1067,7 +1079,7 @@ int devpnc (int class, int func, int device) {
     }
 
     TRACE(T_RIO, "PNC configured\n");
-    devpoll[device] = PNCPOLL*gv.instpermsec;
+    setdevpoll(device, PNCPOLL*gv.instpermsec);
 
     if (gettimeofday(&tv0, NULL) != 0)
       fatal("pnc gettimeofday 1 failed");
@@ -1277,14 +1289,15 @@ int devpnc (int class, int func, int device) {
     pollts = (tv1.tv_sec + tv1.tv_usec/1000000.0) - tv0ts;
     TRACE(T_RIO, " POLL '%02o%02o @ %10.2f\n", func, device, pollts);
 
-    /* on SIGIO, reset to the previous poll time and just do reads;
+    /* on SIGIO, leave the regular poll scheduled and just do reads;
        otherwise, a regularly scheduled poll */
 
     if (sawsigio) {
-      devpoll[device] = olddevpoll;
+      if (getdevpoll(device) == 0)
+	setdevpoll(device, PNCPOLL*gv.instpermsec);
       sawsigio = 0;
     } else {
-      devpoll[device] = PNCPOLL*gv.instpermsec;
+      setdevpoll(device, PNCPOLL*gv.instpermsec);
       time(&timenow);
       pncaccept(timenow);   /* accept 1 new connection each poll */
       pncconnect(timenow);  /* finish a pending connection */
@@ -1300,10 +1313,28 @@ intrexit:
 	gv.intvec = pncvec;
 	intstat |= (pncstat & 0xC000);
       } else
-	devpoll[device] = 100;
+	setdevpoll(device, 100);
     }
     break;
 
+  case -3:
+  case -4:
+
+    /* the ring is reconnected after a restore, but packets in
+       flight are lost, like a ring reconfiguration */
+
+    SNAPVAR(class, pncdiag);
+    SNAPVAR(class, intstat);
+    SNAPVAR(class, pncstat);
+    SNAPVAR(class, rcvstat);
+    SNAPVAR(class, xmitstat);
+    SNAPVAR(class, pncvec);
+    SNAPVAR(class, myid);
+    SNAPVAR(class, enabled);
+    pncsnapdma(class, &rcv);
+    pncsnapdma(class, &xmit);
+    return 0;
+
   default:
     fatal("Bad func in devpcn");
   }
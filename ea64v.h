@@ -1,7 +1,10 @@
 /* this version is derived from the flowchart in the preliminary P400
    release notes */
 
-static inline ea_t ea64v (unsigned short inst, ea_t earp) {
+/* long, 2-word V-mode memory references.  The 2nd word "a" has
+   already been fetched, either by ea64v or from the predecode cache */
+
+static inline ea_t ea64vlong (unsigned short inst, unsigned short a, ea_t earp) {
 
   ea_t ea;                                       /* full seg/word va */
   unsigned short ea_s;                           /* eff address segno */
@@ -10,9 +13,82 @@ static inline ea_t ea64v (unsigned short inst, ea_t earp) {
   unsigned short i;
   unsigned short x;
   unsigned short xok;
-  unsigned short a;
   unsigned short ixy;
   unsigned short m;
+
+  i = inst & 0100000;
+  x = ((inst & 036000) != 032000) ? (inst & 040000) : 0;
+  ea_s = earp >> 16;
+
+  ixy = (i >> 13) | (x >> 13) | ((inst & 020) >> 4);
+  xok = (inst & 036000) != 032000;        /* true if indexing is okay */
+
+  br = (inst & 3);
+  eap = &gv.brp[br];
+
+#ifndef NOTRACE
+  int opcode;
+
+  opcode = ((inst & 036000) != 032000) ? ((inst & 036000) >> 4) : ((inst & 076000) >> 4);
+  opcode |= ((inst >> 2) & 3);         /* opcode extension */
+  TRACE(T_EAV, " new opcode=%#05o, br=%d, ixy=%d, xok=%d\n", opcode, br, ixy, xok);
+#endif
+
+  ea_s = getcrs16(PBH+br*2) | (ea_s & RINGMASK16);
+  ea_w = getcrs16(PBL+br*2) + a;
+
+  if (xok)
+    if (ixy == 2 || ixy == 6)
+      ea_w += getcrs16(X);
+    else if (ixy == 1 || ixy == 4)
+      ea_w += getcrs16(Y);
+
+#if 0
+    /* if this is a PB% address, use RPBR instead if it's in range
+
+       NOTE: this has been disabled, because gcov showed it only
+       occurred 0.5% of the time */
+
+    if (br == 0 && ((((ea_s & 0x8FFF) << 16) | (ea_w & 0xFC00)) == gv.brp[RPBR].vpn))
+      eap = &gv.brp[RPBR];
+#endif
+
+  if (ixy >= 3) {
+    ea = MAKEVA(ea_s, ea_w);
+    TRACE(T_EAV, " Long indirect, ea=%o/%o, ea_s=%o, ea_w=%o\n", ea>>16, ea&0xFFFF, ea_s, ea_w);
+    m = get16(ea);
+    if (m & 0x8000)
+      fault(POINTERFAULT, m, ea);
+    ea_s = m | (ea_s & RINGMASK16);
+    ea_w = get16(INCVA(ea,1));
+    TRACE(T_EAV, " After indirect, ea_s=%o, ea_w=%o\n", ea_s, ea_w);
+
+    /* when passing stack variables, callee references will be
+       SB%+20,*, which may still be in the same page.  Don't switch to
+       UNBR if the new ea is still in the current page */
+
+    if ((((ea_s & 0x8FFF) << 16) | (ea_w & 0xFC00)) != (eap->vpn & 0x0FFFFFFF))
+      eap = &gv.brp[UNBR];
+
+    if (xok)
+      if (ixy == 7) {
+	TRACE(T_EAV, " Postindex, old ea_w=%o, X='%o/%d\n", ea_w, getcrs16(X), getcrs16s(X));
+	ea_w += getcrs16(X);
+      } else if (ixy == 5) {
+	TRACE(T_EAV, " Postindex, old ea_w=%o, Y='%o/%d\n", ea_w, getcrs16(Y), getcrs16s(Y));
+	ea_w += getcrs16(Y);
+      }
+  }
+  return MAKEVA(ea_s, ea_w);
+}
+
+static inline ea_t ea64v (unsigned short inst, ea_t earp) {
+
+  unsigned short ea_s;                           /* eff address segno */
+  unsigned short ea_w;                           /* eff address wordno */
+  unsigned short i;
+  unsigned short x;
+  unsigned short a;
   unsigned short rph,rpl;
 
 
@@ -36,66 +112,7 @@ static inline ea_t ea64v (unsigned short inst, ea_t earp) {
     a = iget16(RP);
     INCRP;
     TRACE(T_EAV, " 2-word format, a=%o\n", a);
-    ixy = (i >> 13) | (x >> 13) | ((inst & 020) >> 4);
-    xok = (inst & 036000) != 032000;        /* true if indexing is okay */
-
-    br = (inst & 3);
-    eap = &gv.brp[br];
-
-#ifndef NOTRACE
-    int opcode;
-
-    opcode = ((inst & 036000) != 032000) ? ((inst & 036000) >> 4) : ((inst & 076000) >> 4);
-    opcode |= ((inst >> 2) & 3);         /* opcode extension */
-    TRACE(T_EAV, " new opcode=%#05o, br=%d, ixy=%d, xok=%d\n", opcode, br, ixy, xok);
-#endif
-
-    ea_s = getcrs16(PBH+br*2) | (ea_s & RINGMASK16);
-    ea_w = getcrs16(PBL+br*2) + a;
-
-    if (xok)
-      if (ixy == 2 || ixy == 6)
-	ea_w += getcrs16(X);
-      else if (ixy == 1 || ixy == 4)
-	ea_w += getcrs16(Y);
-
-#if 0
-      /* if this is a PB% address, use RPBR instead if it's in range
-
-	 NOTE: this has been disabled, because gcov showed it only
-	 occurred 0.5% of the time */
-
-      if (br == 0 && ((((ea_s & 0x8FFF) << 16) | (ea_w & 0xFC00)) == gv.brp[RPBR].vpn))
-	eap = &gv.brp[RPBR];
-#endif
-
-    if (ixy >= 3) {
-      ea = MAKEVA(ea_s, ea_w);
-      TRACE(T_EAV, " Long indirect, ea=%o/%o, ea_s=%o, ea_w=%o\n", ea>>16, ea&0xFFFF, ea_s, ea_w);
-      m = get16(ea);
-      if (m & 0x8000)
-	fault(POINTERFAULT, m, ea);
-      ea_s = m | (ea_s & RINGMASK16);
-      ea_w = get16(INCVA(ea,1));
-      TRACE(T_EAV, " After indirect, ea_s=%o, ea_w=%o\n", ea_s, ea_w);
-
-      /* when passing stack variables, callee references will be
-	 SB%+20,*, which may still be in the same page.  Don't switch to
-	 UNBR if the new ea is still in the current page */
-
-      if ((((ea_s & 0x8FFF) << 16) | (ea_w & 0xFC00)) != (eap->vpn & 0x0FFFFFFF))
-	eap = &gv.brp[UNBR];
-
-      if (xok)
-	if (ixy == 7) {
-	  TRACE(T_EAV, " Postindex, old ea_w=%o, X='%o/%d\n", ea_w, getcrs16(X), getcrs16s(X));
-	  ea_w += getcrs16(X);
-	} else if (ixy == 5) {
-	  TRACE(T_EAV, " Postindex, old ea_w=%o, Y='%o/%d\n", ea_w, getcrs16(Y), getcrs16s(Y));
-	  ea_w += getcrs16(Y);
-	}
-    }
-    return MAKEVA(ea_s, ea_w);
+    return ea64vlong(inst, a, earp);
   }
 
   /* now check for direct short-form - the 2nd-most frequent case */
@@ -112,9 +112,12 @@ gv.tracetriggered = 1; this simulates the Ctrl-t.
 
 #ifdef __APPLE__
   #define OSX 1
+#else
+  #define _GNU_SOURCE     /* for strcasestr, SEEK_DATA, SEEK_HOLE */
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -134,6 +137,11 @@ gv.tracetriggered = 1; this simulates the Ctrl-t.
 #include <time.h>
 #include <sys/file.h>
 #include <glob.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/wait.h>
 
 /* In SR modes, Prime CPU registers are mapped to memory locations
    0-'37, but only 0-7 are user accessible.  In the post-P300
@@ -160,21 +168,41 @@ static void fatal(char *msg) __attribute__ ((noreturn));
 static void warn(char *msg);
 static void macheck (unsigned short p300vec, unsigned short chkvec, unsigned int dswstat, unsigned int dswrma) __attribute__ ((noreturn));
 
-/* condition code macros */
+/* condition code macros
+
+   The LT and EQ condition codes (and C and L for add16/add32) are
+   evaluated lazily: instead of updating keys after every instruction
+   that sets the CCs, the result is saved in gv.ccval and gv.cckind
+   says how to derive the CCs from it.  Most CCs are overwritten
+   before anything tests them.  getkeys() computes the CCs and stores
+   them in keys if they are pending; putkeys() stores keys and
+   cancels any pending CCs.
+
+   IMPORTANT: anything that looks at the keys register other than
+   through getkeys() - register file addressing or switching
+   register sets - must call ccflush() first. */
 
-#define CLEARCC putcrs16(KEYS, getcrs16(KEYS) & ~0300)
-#define CLEAREQ putcrs16(KEYS, getcrs16(KEYS) & ~0100)
-#define CLEARLT putcrs16(KEYS, getcrs16(KEYS) & ~0200)
-#define SETEQ putcrs16(KEYS, getcrs16(KEYS) | 0100)
-#define SETLT putcrs16(KEYS, getcrs16(KEYS) | 0200)
+#define CC_KEYS  0                /* keys are up to date */
+#define CC_RES   1                /* LT, EQ from (int) ccval */
+#define CC_ADD16 2                /* C, L, LT, EQ from 17-bit sum */
+#define CC_ADD32 3                /* C, L, LT, EQ from 33-bit sum */
 
-/* set condition codes based on a 16-bit signed value */
+#define getkeys() (gv.cckind != CC_KEYS ? ccflush() : getcrs16(KEYS))
+
+#define CLEARCC putkeys(getkeys() & ~0300)
+#define CLEAREQ putkeys(getkeys() & ~0100)
+#define CLEARLT putkeys(getkeys() & ~0200)
+#define SETEQ putkeys(getkeys() | 0100)
+#define SETLT putkeys(getkeys() | 0200)
+
+/* set condition codes based on a 16-bit signed value.  A pending
+   add has C and L bits that must be kept, so flush it first */
 
 #define SETCC_16(val16) \
-  if ((val16) != 0) \
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0300) | ((unsigned short)((val16) & 0x8000) >> 8)); \
-  else \
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0300) | 0100);
+  if (gv.cckind > CC_RES) \
+    ccflush(); \
+  gv.ccval = (short)(val16); \
+  gv.cckind = CC_RES;
 
 /* set condition codes based on A register (16-bit signed) */
 
@@ -183,10 +211,10 @@ static void macheck (unsigned short p300vec, unsigned short chkvec, unsigned int
 /* set condition codes based on a 32-bit signed value */
 
 #define SETCC_32(val32) \
-  if ((val32) != 0) \
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0300) | ((unsigned int)((val32) & 0x80000000) >> 24)); \
-  else \
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0300) | 0100);
+  if (gv.cckind > CC_RES) \
+    ccflush(); \
+  gv.ccval = (int)(val32); \
+  gv.cckind = CC_RES;
 
 /* set condition codes based on L register (32-bit signed) */
 
@@ -202,16 +230,9 @@ static void macheck (unsigned short p300vec, unsigned short chkvec, unsigned int
    - Prime only tested 32 bits of the fraction, even for double
    precision.  It expected DP floats to be normalized, or mostly
    normalized.
-
-   XXX: #define SETCC_F SETCC_32(getcrs32(FLTH))
 */
   
-#define SETCC_F \
-  CLEARCC; \
-  if (getcrs32s(FLTH) < 0) \
-    SETLT; \
-  else if (getcrs32s(FLTH) == 0) \
-    SETEQ;
+#define SETCC_F SETCC_32(getcrs32(FLTH))
 
 #define SETCC_D SETCC_F
 
@@ -219,24 +240,24 @@ static void macheck (unsigned short p300vec, unsigned short chkvec, unsigned int
 /* macros for handling the C-bit (overflow) and L-bit (carry out) */
 
 #define EXPC(onoff) \
-  if ((onoff)) putcrs16(KEYS, getcrs16(KEYS) | 0100000);	\
-  else putcrs16(KEYS, getcrs16(KEYS) & 077777)
+  if ((onoff)) putkeys(getkeys() | 0100000);	\
+  else putkeys(getkeys() & 077777)
 
-#define SETC putcrs16(KEYS, getcrs16(KEYS) | 0100000)
-#define CLEARC putcrs16(KEYS, getcrs16(KEYS) & 077777)
+#define SETC putkeys(getkeys() | 0100000)
+#define CLEARC putkeys(getkeys() & 077777)
 
 /* EXPCL sets both the C and L bits for shift instructions */
 
 #define EXPCL(onoff) \
-  if ((onoff)) putcrs16(KEYS, getcrs16(KEYS) | 0120000);	\
-  else putcrs16(KEYS, getcrs16(KEYS) & ~0120000)
+  if ((onoff)) putkeys(getkeys() | 0120000);	\
+  else putkeys(getkeys() & ~0120000)
 
-#define SETCL putcrs16(KEYS, getcrs16(KEYS) | 0120000)
-#define CLEARCL putcrs16(KEYS, getcrs16(KEYS) & ~0120000)
+#define SETCL putkeys(getkeys() | 0120000)
+#define CLEARCL putkeys(getkeys() & ~0120000)
 
 #define SETL(onoff) \
-  if ((onoff)) putcrs16(KEYS, getcrs16(KEYS) | 020000);	\
-  else putcrs16(KEYS, getcrs16(KEYS) & ~020000)
+  if ((onoff)) putkeys(getkeys() | 020000);	\
+  else putkeys(getkeys() & ~020000)
 
 /* XSETL is a dummy to indicate that the L-bit may not be set correctly */
 
@@ -244,24 +265,24 @@ static void macheck (unsigned short p300vec, unsigned short chkvec, unsigned int
 
 /* these macros are for the VI-mode branch insructions */
 
-#define BCLT if   (getcrs16(KEYS) & 0200)  RPL = iget16(RP); else INCRP
-#define BCLE if   (getcrs16(KEYS) & 0300)  RPL = iget16(RP); else INCRP
-#define BCEQ if   (getcrs16(KEYS) & 0100)  RPL = iget16(RP); else INCRP
-#define BCNE if (!(getcrs16(KEYS) & 0100)) RPL = iget16(RP); else INCRP
-#define BCGE if (!(getcrs16(KEYS) & 0200)) RPL = iget16(RP); else INCRP
-#define BCGT if (!(getcrs16(KEYS) & 0300)) RPL = iget16(RP); else INCRP
-#define BLS  if  (getcrs16(KEYS) & 020000) RPL = iget16(RP); else INCRP
+#define BCLT if   (getkeys() & 0200)  RPL = iget16(RP); else INCRP
+#define BCLE if   (getkeys() & 0300)  RPL = iget16(RP); else INCRP
+#define BCEQ if   (getkeys() & 0100)  RPL = iget16(RP); else INCRP
+#define BCNE if (!(getkeys() & 0100)) RPL = iget16(RP); else INCRP
+#define BCGE if (!(getkeys() & 0200)) RPL = iget16(RP); else INCRP
+#define BCGT if (!(getkeys() & 0300)) RPL = iget16(RP); else INCRP
+#define BLS  if  (getkeys() & 020000) RPL = iget16(RP); else INCRP
 #define BHNE(r) if (getgr16((r)) != 0) RPL = iget16(RP); else INCRP
 #define BRNE(r) if (getgr32((r)) != 0) RPL = iget16(RP); else INCRP
 
 /* expressions for logicize instructions */
 
-#define LCLT ((getcrs16(KEYS) & 0200) != 0)
-#define LCLE ((getcrs16(KEYS) & 0300) != 0)
-#define LCEQ ((getcrs16(KEYS) & 0100) != 0)
-#define LCNE ((getcrs16(KEYS) & 0100) == 0)
-#define LCGE !(getcrs16(KEYS) & 0200)
-#define LCGT ((getcrs16(KEYS) & 0300) == 0)
+#define LCLT ((getkeys() & 0200) != 0)
+#define LCLE ((getkeys() & 0300) != 0)
+#define LCEQ ((getkeys() & 0100) != 0)
+#define LCNE ((getkeys() & 0100) == 0)
+#define LCGE !(getkeys() & 0200)
+#define LCGT ((getkeys() & 0300) == 0)
 
 /* macro for restricted instructions (uses current program counter) */
 
@@ -356,12 +377,23 @@ static unsigned short firstbdx = 0;         /* backstop sleep flag */
    CPU w/max of 16MB physical memory via the extended page map format */
 
 static unsigned short cpuid = 15;      /* STPM CPU model, set with -cpuid */
+static int stlbsets = 0;               /* STLB geometry, set with -stlb; */
+static int stlbways = 0;               /* 0 means use the cpuid preset */
 
 /* STLB cache structure is defined here; the actual stlb is in gv.
    There are several different styles on Prime models.  This is
-   modeled after the 6350 STLB, but is only 1-way associative.
-   The hit rate has been measured to be over 99.8% with a single
-   user.
+   modeled after the 6350 STLB, but is set associative: each set
+   holds 1, 2, or 4 ways kept in LRU order, way 0 being the most
+   recently used.  With one user the old 1-way table measured over
+   99.8%, but with many users running in private segments, entries
+   for the same segment number and different owners fight over the
+   same slot, and every miss costs a DTAR/SDW/PTE walk in mapva.
+
+   The geometry is set with -stlb, or from the cpu model (stlbpreset).
+   The number of sets is 512 to STLBMAXSETS.  The low 9 bits of the
+   set index are the 6350 hash; the hash and segment number together
+   determine the page, which is why entries don't store the page
+   number.  Larger tables add more segment bits to the index.
 
    Instead of using a valid/invalid bit, a segment number of 0xFFFF
    (note that the fault, ring, and E bits are set) means "invalid",
@@ -375,7 +407,9 @@ static unsigned short cpuid = 15;      /* STPM CPU model, set with -cpuid */
    the fast path of a _very_ speed-critical routine (mapva).
 */
 
-#define STLBENTS 512
+#define STLBMAXSETS 2048
+#define STLBMAXWAYS 4
+#define STLBENTS (STLBMAXSETS*STLBMAXWAYS)
 #define STLB_UNMODIFIED_BIT 2 /* stored in access[2] */
 
 typedef struct {
@@ -467,20 +501,53 @@ typedef struct {
    allowed) is used, but since a 3-bit value comes back from mapva,
    it's easier just to put it all in vpn.
 
-   IMPORTANT NOTE: the "get" calls do not store the access field in
-   the brp cache entry; the first write to a page must clear the "page
-   unmodified" bit in the Primos page maps, and mapva is the only way
-   to do this.  So the first "put" has to go through mapva.  An
-   alternative would be to store the page map pointer in brp and use
-   bit 3 of vpn as a flag for whether the page map has to be modified,
-   but this is more work for probably little gain.
+   The first write to a page must clear the "page unmodified" bit in
+   the Primos page map.  brpload copies the page map pointer and the
+   STLB's unmodified bit into the brp entry, so "get" calls can store
+   the access field too, and the first "put" through an entry clears
+   the page map bit inline (brpmodify) instead of going through mapva.
  */
 
 typedef struct {
   unsigned short *memp;       /* MEM[] physical page address */
   ea_t vpn;                   /* corresponding virtual page address */
+  unsigned int pmaddr;        /* Prime phys addr of page map entry */
+  unsigned int modified;      /* 0 if page map unmodified bit is set */
 } brp_t;
 
+/* The host TLB (htlb) is a larger, direct-mapped cache of pages that
+   mapva has mapped, for accesses that miss the brp cache and for the
+   "r" get/put calls that pass in a ring.  The tag holds the access
+   ring (bits 2-3), segment, and page, like an ea, with a generation
+   number in the low 10 bits.  invalidate_brp bumps the generation,
+   so the htlb is invalidated along with the brp cache.
+
+   htlbpage has the generation that last loaded each physical page.
+   A single-page PTLB only bumps the generation if the page may still
+   be in the htlb, rather than searching all of it for the page.
+
+   A hit is the same as an STLB hit in mapva: the access rights for
+   the ring are in access, and a write clears the page map unmodified
+   bit if it's still set.  Entries are only loaded by read or write
+   accesses, so access always includes read. */
+
+#define HTLBENTS 1024                  /* must be a power of 2 */
+#define HTLBGENMASK 0x3FF
+
+#define HTLBIX(ea) ((((ea) >> 10) ^ ((ea) >> 13)) & (HTLBENTS-1))
+
+typedef struct {
+  ea_t tag;                   /* ring, seg, page | htlbgen */
+  unsigned short *memp;       /* MEM[] physical page address */
+  unsigned int pmaddr;        /* Prime phys addr of page map entry */
+  unsigned char access;       /* access rights for the ring */
+  unsigned char modified;     /* 0 if page map unmodified bit is set */
+} htlbe_t;
+
+static htlbe_t htlb[HTLBENTS];
+static unsigned int htlbgen = 1;
+static unsigned short *htlbpage;
+
 /* the dispatch table for generic instructions:
    - bits 1-2 are the class (0-3)
    - bits 3-6 are always zero
@@ -502,6 +569,8 @@ typedef struct {
 
   unsigned int instcount;       /* global instruction count */
 
+  unsigned int nextpoll;        /* instcount of next device poll */
+
   brp_t brp[BRP_SIZE];          /* PB, SB, LB, XB, RP, S0, F0, F1, UN */
 
   unsigned short inhcount;      /* number of instructions to stay inhibited */
@@ -509,6 +578,8 @@ typedef struct {
   unsigned int instpermsec;     /* instructions executed per millisecond */
 
   stlbe_t stlb[STLBENTS];       /* the STLB: Segmentation Translation Lookaside Buffer */
+  unsigned int stlbsetmask;     /* STLB sets-1 */
+  int stlbwshift;               /* log2 of STLB ways */
 
   iotlbe_t iotlb[IOTLBENTS];    /* the IOTLB: I/O Translation Lookaside Buffer */
 
@@ -524,8 +595,11 @@ typedef struct {
 
   unsigned int livereglim;      /* 010 if seg enabled, 040 if disabled */
 
-  int mapvacalls;               /* # of mapva calls */
-  int mapvamisses;              /* STLB misses */
+  int cckind;                   /* lazy condition codes: CC_xxx */
+  unsigned long long ccval;     /* value the CCs are based on */
+
+  unsigned long long mapvacalls;   /* # of mapva calls */
+  unsigned long long mapvamisses;  /* STLB misses */
   int supercalls;               /* brp supercache hits */
   int supermisses;              /* brp supercache misses */
 
@@ -561,6 +635,43 @@ typedef struct {
 
 static gv_t gv;
 
+/* computes pending condition codes and stores them in keys */
+
+static unsigned short ccflush() {
+  unsigned short keys;
+
+  keys = getcrs16(KEYS);
+  switch (gv.cckind) {
+  case CC_KEYS:
+    return keys;
+  case CC_RES:
+    keys &= ~0300;
+    if ((int)gv.ccval < 0)
+      keys |= 0200;
+    else if ((int)gv.ccval == 0)
+      keys |= 0100;
+    break;
+  case CC_ADD16:
+    keys = (keys & ~0120300) | ((gv.ccval & 0x10000) >> 3) | ((gv.ccval & 0x8000) >> 8);
+    if ((gv.ccval & 0xFFFF) == 0)
+      keys |= 0100;
+    break;
+  case CC_ADD32:
+    keys = (keys & ~0120300) | ((gv.ccval & 0x100000000LL) >> 19) | ((gv.ccval & 0x80000000) >> 24);
+    if ((gv.ccval & 0xFFFFFFFF) == 0)
+      keys |= 0100;
+    break;
+  }
+  gv.cckind = CC_KEYS;
+  putcrs16(KEYS, keys);
+  return keys;
+}
+
+static inline void putkeys(unsigned short keys) {
+  gv.cckind = CC_KEYS;
+  putcrs16(KEYS, keys);
+}
+
 brp_t *eap;
 
 static  jmp_buf jmpbuf;               /* for longjumps to the fetch loop */
@@ -577,21 +688,354 @@ static  jmp_buf bootjmp;               /* for longjumps to the fetch loop */
    "memlimit" is set with the -mem argument, taking an argument which is
    the desired memory limit in MB.  Setting a memory limit is useful to
    speed up system boots and diagnostics during emulator testing.
+
+   Physical memory is an anonymous mapping with MAP_NORESERVE, so host
+   memory is only committed for pages Primos actually touches.  With
+   -mem n huge, it's also backed by transparent huge pages, to cut
+   host TLB misses on MEM[] references.
 */
 
-#define MAXMB   32     /* must be a power of 2 */
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#define MAXMB   512    /* must be a power of 2 */
 #define MEMSIZE MAXMB/2*1024*1024
 #define MEMMASK MEMSIZE-1
 #define MEM physmem
 
 static unsigned short *physmem = NULL; /* system's physical memory */
 
+/* Predecoded instruction cache (pdc).  Decoding a V-mode instruction
+   means fetching it through RPBR, testing the CPU mode, computing the
+   dispatch index, and for long-form memory references, fetching the
+   2nd word.  The pdc remembers the result of this work for each word
+   of a few recently executed physical pages, so that a tight loop
+   only decodes each instruction once.
+
+   The cache is keyed by physical page, not virtual page, so it
+   survives process exchange and shared procedure segments mapped at
+   different addresses.  Each page slot has a generation number;
+   an entry is valid only if its generation matches the slot's.
+   Loading a new page into a slot bumps the generation, invalidating
+   all entries at once without a 24K memset.
+
+   Every store to physical memory must call pdcinvword (or
+   pdcinvrange for DMA) so that self-modifying code and code pages
+   read in by the disk controller are decoded again.  A store
+   invalidates the word stored and the word before it, since that may
+   be a long-form instruction with the stored word cached in pdce.a.
+
+   Only 64V mode uses the cache; I-mode decode is done by the big
+   switch at imode: and gains little from predecoding. */
+
+#define PDCPAGES 128          /* must be a power of 2 */
+
+#define PDC_GEN    0          /* generic, no EA */
+#define PDC_VSHORT 1          /* V-mode short form, EA from ea64v */
+#define PDC_VLONG  2          /* V-mode long form, 2nd word in pdce.a */
+
+typedef struct {
+  void *disp;                 /* dispatch target */
+  unsigned int gen;           /* == pdcgen[slot] if valid */
+  unsigned short inst;        /* instruction word */
+  unsigned short a;           /* 2nd word of long-form memory ref */
+  unsigned char form;         /* PDC_xxx */
+} pdce_t;
+
+static pdce_t (*pdc)[1024];             /* PDCPAGES page slots */
+static pa_t pdctag[PDCPAGES];           /* page address in each slot */
+static unsigned int pdcgen[PDCPAGES];   /* slot generation number */
+
+/* memdirty has a byte for each physical page, with bits set when the
+   page is stored into.  Since every store comes through pdcinvword or
+   pdcinvrange, it's maintained there; -checkpoint uses it to only
+   write changed pages */
+
+#define MEMDIRTY 3                      /* 1 bit per checkpoint file */
+
+static unsigned char *memdirty;
+
+/* The SDW cache holds decoded segment descriptors so an STLB miss
+   only has to read the page map.  There are SDWCTABS tables for each
+   DTAR, indexed by the segment number within the DTAR.  Each table
+   holds the descriptors for the DTAR value in sdwcdtar, and sdwcord
+   keeps a DTAR's tables in LRU order, with the table for the current
+   DTAR value first.  When the DTAR changes (pxregload loading DTAR2/3
+   for a new process, or STLR), a table for the new value is moved to
+   the front, or the least recently used table is reused and dropped
+   by bumping its generation number, like the predecode cache.  So a
+   process's descriptors survive while it's switched out, as long as
+   not too many other processes run before it's switched back in.
+
+   Descriptors that cause a segment fault are not cached.  Pages
+   holding cached descriptors are marked in cachepage, and a store to a
+   marked page drops the whole cache.  LIOT, PTLB, and ITLB drop
+   entries too, since Primos issues these after changing descriptors */
+
+#define SDWCTABS 8                      /* tables per DTAR */
+#define SDWCPAGES 64                    /* max descriptor pages marked */
+
+typedef struct {
+  unsigned int gen;                     /* == sdwcgen[dtar][tab] if valid */
+  unsigned int ptaddr;                  /* page table address */
+  unsigned char access[4];              /* ring 1 & 3 access, as in STLB */
+} sdwce_t;
+
+static sdwce_t sdwc[4][SDWCTABS][1024];
+static unsigned int sdwcgen[4][SDWCTABS]; /* generation of each table */
+static unsigned int sdwcdtar[4][SDWCTABS]; /* DTAR value for each table */
+static unsigned char sdwcord[4][SDWCTABS]; /* tables in LRU order */
+static unsigned int sdwpages[SDWCPAGES]; /* list of marked pages */
+static int nsdwpages;
+
+/* cachepage has a byte for each physical page, with bits set when
+   the page holds data cached in decoded form.  A store to the page
+   has to drop the cache */
+
+#define CP_SDW 1                        /* SDW cache */
+#define CP_ECB 2                        /* ECB cache */
+#define CP_PXR 4                        /* process register cache */
+
+static unsigned char *cachepage;
+
+static void sdwcinv(int dtarx, int tab) {
+
+  if (++sdwcgen[dtarx][tab] == 0) {
+    memset(sdwc[dtarx][tab], 0, sizeof(sdwc[dtarx][tab]));
+    sdwcgen[dtarx][tab] = 1;
+  }
+}
+
+static void sdwcinvall() {
+  int i, tab;
+
+  for (i=0; i < 4; i++)
+    for (tab=0; tab < SDWCTABS; tab++) {
+      sdwcinv(i, tab);
+      sdwcord[i][tab] = tab;
+    }
+  for (i=0; i < nsdwpages; i++)
+    cachepage[sdwpages[i]] &= ~CP_SDW;
+  nsdwpages = 0;
+}
+
+/* returns the table for a DTAR value, moving it to the front of the
+   LRU order.  If no table has the value, the least recently used one
+   is dropped and reused */
+
+static int sdwctab(int dtarx, unsigned int dtar) {
+  unsigned char *ord;
+  int i, tab;
+
+  ord = sdwcord[dtarx];
+  if (sdwcdtar[dtarx][ord[0]] == dtar)
+    return ord[0];
+  for (i=1; i < SDWCTABS-1; i++)
+    if (sdwcdtar[dtarx][ord[i]] == dtar)
+      break;
+  tab = ord[i];
+  if (sdwcdtar[dtarx][tab] != dtar) {
+    sdwcinv(dtarx, tab);
+    sdwcdtar[dtarx][tab] = dtar;
+  }
+  memmove(ord+1, ord, i);
+  ord[0] = tab;
+  return tab;
+}
+
+/* The ECB cache holds decoded entry control blocks for PCL.  Like the
+   predecode cache it's keyed by physical address, so it survives
+   process exchange and shared procedures, and like the SDW cache,
+   pages holding cached ECBs are marked in cachepage and a store to a
+   marked page drops the whole cache.  Access is still checked on
+   every PCL since it depends on the caller's ring.  ECBs that cross
+   a page boundary are not cached. */
+
+#define ECBCENTS 256                    /* must be a power of 2 */
+#define ECBCPAGES 32                    /* max ECB pages marked */
+#define ECBCIX(pa) (((pa) ^ ((pa) >> 8)) & (ECBCENTS-1))
+
+typedef struct {
+  unsigned int gen;                     /* == ecbcgen if valid */
+  pa_t pa;                              /* physical address of ECB */
+  ea_t pb;                              /* entry point, words 0-1 */
+  ea_t lb;                              /* new LB, words 6-7 */
+  unsigned short framesize;             /* word 2, rounded up to even */
+  unsigned short stackroot;             /* word 3 */
+  unsigned short argdisp;               /* word 4 */
+  unsigned short nargs;                 /* word 5 */
+  unsigned short keys;                  /* word 8 */
+} ecbce_t;
+
+static ecbce_t ecbc[ECBCENTS];
+static unsigned int ecbcgen = 1;
+static unsigned int ecbpages[ECBCPAGES]; /* list of marked pages */
+static int necbpages;
+
+static void ecbcinvall() {
+  int i;
+
+  if (++ecbcgen == 0) {
+    memset(ecbc, 0, sizeof(ecbc));
+    ecbcgen = 1;
+  }
+  for (i=0; i < necbpages; i++)
+    cachepage[ecbpages[i]] &= ~CP_ECB;
+  necbpages = 0;
+}
+
+/* The process register cache holds copies of the register save
+   areas of recently run processes' PCBs (DTAR2 through the saved
+   registers), in the form pxregload needs them, so a process that is
+   dispatched again soon doesn't have to reload from its PCB.  Entries
+   are keyed by the physical address of the save area, which must be
+   in one page.  They are written when pxregsave stores the registers
+   and when pxregload reads them, so the PCB is always up to date and
+   Primos can look at it any time.
+
+   Pages holding cached save areas are marked in cachepage and stay
+   marked.  A store to a marked page only drops the entry for the
+   save area stored into, since process exchange is constantly
+   storing into other parts of the PCBs. */
+
+#define PXRCENTS 64                     /* must be a power of 2 */
+#define PXRCIX(pa) (((pa) >> 6) & (PXRCENTS-1))  /* PCBs are 64 words */
+#define PXRCWORDS (PCBREGS+32-PCBDTAR2) /* size of the save area */
+
+typedef struct {
+  pa_t pa;                              /* pa of pcb+PCBDTAR2, or -1 */
+  unsigned int gr[16];                  /* general registers */
+  unsigned int dtar2, dtar3, timer;
+  unsigned short keys;
+} pxrce_t;
+
+static pxrce_t pxrc[PXRCENTS];
+
+static void pxrcinvall() {
+  int i;
+
+  for (i=0; i < PXRCENTS; i++)
+    pxrc[i].pa = 0xFFFFFFFF;
+}
+
+/* drops the entries for save areas overlapping a range of physical
+   memory */
+
+static void pxrcinv(pa_t pa, int nw) {
+  int i;
+
+  if (nw == 1) {
+    if (pa - pxrc[PXRCIX(pa)].pa < PXRCWORDS)
+      pxrc[PXRCIX(pa)].pa = 0xFFFFFFFF;
+    if (pa - pxrc[PXRCIX(pa-PXRCWORDS+1)].pa < PXRCWORDS)
+      pxrc[PXRCIX(pa-PXRCWORDS+1)].pa = 0xFFFFFFFF;
+  } else
+    for (i=0; i < PXRCENTS; i++)
+      if (pxrc[i].pa - pa < nw)
+	pxrc[i].pa = 0xFFFFFFFF;
+}
+
+/* drops the cached data for nw words of a physical page that is
+   being stored into */
+
+static void cachepageinv(pa_t pa, int nw) {
+
+  if (cachepage[pa >> 10] & CP_SDW)
+    sdwcinvall();
+  if (cachepage[pa >> 10] & CP_ECB)
+    ecbcinvall();
+  if (cachepage[pa >> 10] & CP_PXR)
+    pxrcinv(pa, nw);
+}
+
+/* invalidates the entire predecode cache */
+
+static void pdcinvall() {
+  int i;
+
+  for (i=0; i < PDCPAGES; i++)
+    pdctag[i] = 0xFFFFFFFF;
+}
+
+/* loads a new physical page into a pdc slot */
+
+static void pdcload(int slot, pa_t pagea) {
+
+  pdctag[slot] = pagea;
+  if (++pdcgen[slot] == 0) {
+    memset(pdc[slot], 0, sizeof(pdc[slot]));
+    pdcgen[slot] = 1;
+  }
+}
+
+static inline void pdcinvword(pa_t pa) {
+  int slot;
+
+  if (pa < gv.memlimit) {
+    memdirty[pa >> 10] = MEMDIRTY;
+    if (cachepage[pa >> 10])
+      cachepageinv(pa, 1);
+  }
+  slot = (pa >> 10) & (PDCPAGES-1);
+  if (pdctag[slot] == (pa & 0xFFFFFC00)) {
+    pdc[slot][pa & 0x3FF].gen = 0;
+    pdc[slot][(pa-1) & 0x3FF].gen = 0;
+  }
+}
+
+/* invalidates all cached pages in a physical address range; used
+   for DMA transfers */
+
+static void pdcinvrange(pa_t pa, int nw) {
+  pa_t pagea;
+
+  if (nw <= 0)
+    return;
+  for (pagea = pa & 0xFFFFFC00; pagea <= pa+nw-1; pagea += 1024) {
+    if (pagea < gv.memlimit) {
+      memdirty[pagea >> 10] = MEMDIRTY;
+      if (cachepage[pagea >> 10])
+	cachepageinv(pagea, 1024);
+    }
+    if (pdctag[(pagea >> 10) & (PDCPAGES-1)] == pagea)
+      pdctag[(pagea >> 10) & (PDCPAGES-1)] = 0xFFFFFFFF;
+  }
+}
+
+/* drops a page's decoded instructions without marking it stored
+   into; for PTLB, LIOT, and ITLB, which remap a page frame but don't
+   change its contents */
+
+static void pdcinvpage(pa_t pagea) {
+
+  pagea &= 0xFFFFFC00;
+  if (pdctag[(pagea >> 10) & (PDCPAGES-1)] == pagea)
+    pdctag[(pagea >> 10) & (PDCPAGES-1)] = 0xFFFFFFFF;
+}
+
 #define get16mem(phyaddr) swap16(MEM[(phyaddr)])
-#define put16mem(phyaddr, val) MEM[(phyaddr)] = swap16((val))
 #define get32mem(phyaddr) swap32(*(unsigned int *)(MEM+phyaddr))
-#define put32mem(phyaddr, val) *(unsigned int *)(MEM+phyaddr) = swap32((val))
 #define get64mem(phyaddr) swap64(*(unsigned long long *)(MEM+phyaddr))
-#define put64mem(phyaddr, val) *(unsigned long long *)(MEM+phyaddr) = swap64((val))
+
+static inline void put16mem(pa_t pa, unsigned short val) {
+  pdcinvword(pa);
+  MEM[pa] = swap16(val);
+}
+
+static inline void put32mem(pa_t pa, unsigned int val) {
+  pdcinvword(pa);
+  pdcinvword(pa+1);
+  *(unsigned int *)(MEM+pa) = swap32(val);
+}
+
+static inline void put64mem(pa_t pa, unsigned long long val) {
+  pdcinvword(pa);
+  pdcinvword(pa+1);
+  pdcinvword(pa+2);
+  pdcinvword(pa+3);
+  *(unsigned long long *)(MEM+pa) = swap64(val);
+}
 
 #define MAKEVA(seg,word) ((((int)(seg))<<16) | (word))
 
@@ -661,6 +1105,26 @@ static int domemdump;                       /* -memdump arg */
 static int tport;                           /* -tport option (incoming terminals) */
 static int nport;                           /* -nport option (PNC/Ringnet) */
 static in_addr_t bindaddr = INADDR_ANY;     /* -naddr option (PnC/Ringnet) */
+static int diskmap;                         /* -diskmap option (mmap disks) */
+static int diskmapadvice = MADV_NORMAL;     /* -diskmap seq|random */
+static int diskmapsync;                     /* -diskmap sync */
+static int memhuge;                         /* -mem n huge */
+#ifdef DISKSAFE
+#define DS_COMMIT 1
+#define DS_DISCARD 2
+static int disksafeop;                      /* -disksafe commit|discard */
+static char *diskbase;                      /* -diskbase option */
+#endif
+static char *snapfile;                      /* -snapshot file (SIGUSR1) */
+static char *restorefile;                   /* -restore file */
+static volatile sig_atomic_t snapwanted;    /* SIGUSR1 seen */
+static char *ckptfile;                      /* -checkpoint file */
+static int ckptmins = 5;                    /* -checkpoint interval */
+static volatile sig_atomic_t ckptwanted;    /* checkpoint timer expired */
+static FILE *snapfp;                        /* open snapshot file */
+static int snapslot;                        /* snapshot's checkpoint file, or -1 */
+static int snapcopies;                      /* its disk overlay copies to make */
+static int snapcopyfail;                    /* an overlay copy failed */
 
 /* load map related data, specified with -map */
 
@@ -676,11 +1140,32 @@ static struct {
 
 /* invalidates all entries in the mapva supercache */
 
-void inline invalidate_brp() {
+static inline void invalidate_brp() {
   int i;
 
   for (i=0; i < BRP_SIZE; i++)
     gv.brp[i].vpn = 0x000000FF;
+  if (++htlbgen > HTLBGENMASK) {
+    for (i=0; i < HTLBENTS; i++)
+      htlb[i].tag = 0;
+    htlbgen = 1;
+  }
+}
+
+/* invalidates the brp and htlb entries for a physical page */
+
+static void brpinvpage(pa_t ppa) {
+  int i;
+
+  for (i=0; i < BRP_SIZE; i++)
+    if (gv.brp[i].memp == MEM+ppa)
+      gv.brp[i].vpn = 0x000000FF;
+  if (ppa < gv.memlimit && htlbpage[ppa >> 10] == htlbgen)
+    if (++htlbgen > HTLBGENMASK) {
+      for (i=0; i < HTLBENTS; i++)
+        htlb[i].tag = 0;
+      htlbgen = 1;
+    }
 }
 
 #ifndef NOTRACE
@@ -869,6 +1354,128 @@ char *searchloadmap(int addr, char type) {
 
 #define STLBIX(ea) ((((((ea) >> 12) ^ (ea)) & 0xc000) >> 7) | (((ea) & 0x70000) >> 12) | ((ea) & 0x3c00) >> 10)
 
+/* STLB set index: the 6350 hash, plus segment bits 3-4 for tables
+   with more than 512 sets.  STLBSETP is the set's way 0 */
+
+#define STLBSET(ea) ((STLBIX(ea) | (((ea) >> 10) & 0x600)) & gv.stlbsetmask)
+#define STLBSETP(ix) (gv.stlb + ((ix) << gv.stlbwshift))
+
+/* true if an STLB entry translates segment seg for the current owner */
+
+#define STLBMATCH(p, seg) ((p)->seg == (seg) && (!((seg) & 04000) || (p)->procid == getcrs16(OWNERL)))
+
+/* invalidates every way of an STLB set, for LIOT and ITLB */
+
+static void stlbinvset(int ix) {
+  stlbe_t *stlbp;
+  int way;
+
+  stlbp = STLBSETP(ix);
+  for (way = 0; way < (1 << gv.stlbwshift); way++, stlbp++)
+    if (stlbp->seg != (short)0xFFFF) {
+      pdcinvpage(stlbp->ppa);
+      stlbp->seg = 0xFFFF;
+    }
+}
+
+/* stlbrmap is a reverse map from physical page to the STLB set
+   holding it, so PTLB doesn't have to search the whole STLB.  It has
+   the set number + 1, 0 if the page hasn't been loaded into the STLB
+   since its last PTLB, or STLBRMULTI if it was loaded into more than
+   one set (it's mapped by several virtual pages).  Entries are not
+   removed when STLB entries are replaced, so a set found here may no
+   longer hold the page.  The map isn't in gv, so it's rebuilt from
+   the STLB after a restore. */
+
+#define STLBRMULTI 0xFFFF
+
+static unsigned short *stlbrmap;
+
+static inline void stlbrmapadd(pa_t ppa, int ix) {
+  unsigned short *rp;
+
+  if (ppa >= gv.memlimit)
+    return;
+  rp = stlbrmap + (ppa >> 10);
+  if (*rp == 0)
+    *rp = ix+1;
+  else if (*rp != ix+1)
+    *rp = STLBRMULTI;
+}
+
+static void stlbrmapbuild() {
+  int i;
+
+  memset(stlbrmap, 0, gv.memlimit/1024*sizeof(*stlbrmap));
+  for (i=0; i < ((gv.stlbsetmask+1) << gv.stlbwshift); i++)
+    if (gv.stlb[i].seg != (short)0xFFFF)
+      stlbrmapadd(gv.stlb[i].ppa, i >> gv.stlbwshift);
+}
+
+/* invalidates the STLB entries for a physical page, for PTLB */
+
+static void stlbinvpage(pa_t ppa) {
+  unsigned short r;
+  int i, first, last;
+
+  if (ppa < gv.memlimit) {
+    r = stlbrmap[ppa >> 10];
+    if (r == 0)
+      return;
+    stlbrmap[ppa >> 10] = 0;
+  } else
+    r = STLBRMULTI;
+  if (r == STLBRMULTI) {
+    first = 0;
+    last = (gv.stlbsetmask+1) << gv.stlbwshift;
+  } else {
+    first = (r-1) << gv.stlbwshift;
+    last = first + (1 << gv.stlbwshift);
+  }
+  for (i=first; i < last; i++)
+    if (gv.stlb[i].ppa == ppa && gv.stlb[i].seg != (short)0xFFFF) {
+      TRACE(T_TLB, "stlb[%d] invalidated at %o/%o for ptlb\n", i, RPH, RPL);
+      gv.stlb[i].seg = 0xFFFF;
+    }
+}
+
+/* sets the STLB geometry: sets is a power of 2 from 512 to
+   STLBMAXSETS, ways is 1, 2, or 4.  All entries are invalidated */
+
+static void stlbsize(int sets, int ways) {
+  int i;
+
+  gv.stlbsetmask = sets-1;
+  for (gv.stlbwshift = 0; (1 << gv.stlbwshift) < ways; gv.stlbwshift++)
+    ;
+  for (i=0; i < STLBENTS; i++)
+    gv.stlb[i].seg = 0xFFFF;
+}
+
+/* default STLB geometry for a cpu model.  The emulated STLB is never
+   smaller than the 512-entry 6350 table; the later models, which ran
+   many more users, get more ways and sets so private segments of
+   different owners don't evict each other */
+
+static void stlbpreset(int cpuid) {
+
+  if (cpuid < 15)                    /* P400 - P2250 */
+    stlbsize(512, 2);
+  else if (cpuid < 33)               /* 9950 - 6550, 2755, 2455 */
+    stlbsize(512, 4);
+  else                               /* 5310 and later */
+    stlbsize(1024, 4);
+}
+
+/* drops a segment's descriptor from all tables for its DTAR */
+
+static void sdwcinvseg(ea_t ea) {
+  int tab;
+
+  for (tab=0; tab < SDWCTABS; tab++)
+    sdwc[DTAR32(ea)][tab][SEGNO32(ea) & 0x3FF].gen = 0;
+}
+
 /* maps a Prime 28-bit virtual address to a physical memory
    address, checks access, returns actual access (for PCL)
 
@@ -888,8 +1495,10 @@ char *searchloadmap(int addr, char type) {
 static pa_t mapva(ea_t ea, ea_t rp, short intacc, unsigned short *access) {
   short relseg,seg,nsegs,ring;
   unsigned short pte, stlbix, iotlbix;
-  stlbe_t *stlbp;
-  unsigned int dtar,sdw,staddr,ptaddr,pmaddr,ppa;
+  int way, ways, dtarx, tab;
+  stlbe_t *stlbp, stlbe;
+  sdwce_t *sdwcp;
+  unsigned int dtar,sdw,staddr,ptaddr,pmaddr,ppa,sdwpagex;
   pa_t pa;
 
 #if 0
@@ -911,39 +1520,63 @@ static pa_t mapva(ea_t ea, ea_t rp, short intacc, unsigned short *access) {
   /* map virtual address if segmentation is enabled */
 
   if (getcrs16(MODALS) & 4) {
-#ifndef NOTRACE
     gv.mapvacalls++;
-#endif
     seg = SEGNO32(ea);
-    stlbix = STLBIX(ea);
-    stlbp = gv.stlb+stlbix;
+    stlbix = STLBSET(ea);
+    stlbp = STLBSETP(stlbix);
 #ifdef DBG
-    if (stlbix >= STLBENTS) {
+    if (stlbix > gv.stlbsetmask) {
       printf("STLB index %d is out of range for va %o/%o!\n", stlbix, ea>>16, ea&0xffff);
       fatal(NULL);
     }
 #endif
 
     /* if the segments don't match, or the segment is private and the
-       process id doesn't match, then the STLB has to be loaded
-       first (invalid entries have a segment of 0xFFFF and won't match) */
-
-    if (stlbp->seg != seg || ((seg & 04000) && stlbp->procid != getcrs16(OWNERL))) {
-#ifndef NOTRACE
+       process id doesn't match, search the other ways of the set.  A
+       hit there is moved to way 0 to keep the set in LRU order.  If
+       no way matches, the STLB has to be loaded (invalid entries have
+       a segment of 0xFFFF and won't match) */
+
+    if (!STLBMATCH(stlbp, seg)) {
+      ways = 1 << gv.stlbwshift;
+      for (way = 1; way < ways; way++)
+	if (STLBMATCH(stlbp+way, seg))
+	  break;
+      if (way < ways) {
+	stlbe = stlbp[way];
+	memmove(stlbp+1, stlbp, way*sizeof(stlbe_t));
+	stlbp[0] = stlbe;
+	goto stlbhit;
+      }
       gv.mapvamisses++;
-#endif
       dtar = getcrs32(DTAR0-2*DTAR32(ea));  /* get dtar register */
       nsegs = 1024-(dtar>>22);
       relseg = seg & 0x3FF;     /* segment within segment table */
       TRACE(T_MAP, "   MAP: ea=%o/%o, seg=%o, dtar=%o, nsegs=%d, relseg=%d, page=%d\n", ea>>16, ea&0xFFFF, seg, dtar, nsegs, relseg, PAGENO(ea));
       if (relseg >= nsegs)
 	fault(SEGFAULT, 1, ea);   /* fcode = segment too big */
-      staddr = (dtar & 0x003F0000) | ((dtar & 0x7FFF)<<1);
-      sdw = get32mem(staddr+relseg*2);
-      TRACE(T_MAP,"        staddr=%o, sdw=%o\n", staddr, sdw);
-      if (sdw & 0x8000)
-	fault(SEGFAULT, 2, ea);   /* fcode = sdw fault bit set */
-      ptaddr = (((sdw & 0x3F)<<10) | (sdw>>22)) << 6;
+      dtarx = DTAR32(ea);
+      tab = sdwctab(dtarx, dtar);
+      sdwcp = &sdwc[dtarx][tab][relseg];
+      if (sdwcp->gen != sdwcgen[dtarx][tab]) {
+	staddr = (dtar & 0x003F0000) | ((dtar & 0x7FFF)<<1);
+	sdw = get32mem(staddr+relseg*2);
+	TRACE(T_MAP,"        staddr=%o, sdw=%o\n", staddr, sdw);
+	if (sdw & 0x8000)
+	  fault(SEGFAULT, 2, ea);   /* fcode = sdw fault bit set */
+	sdwpagex = (staddr+relseg*2) >> 10;
+	if (!(cachepage[sdwpagex] & CP_SDW)) {
+	  if (nsdwpages == SDWCPAGES)
+	    sdwcinvall();
+	  cachepage[sdwpagex] |= CP_SDW;
+	  sdwpages[nsdwpages++] = sdwpagex;
+	}
+	sdwcp->ptaddr = (((sdw & 0x3F)<<10) | (sdw>>22)) << 6;
+	sdwcp->access[1] = (sdw >> 12) & 7;
+	sdwcp->access[3] = (sdw >> 6) & 7;
+	sdwcp->gen = sdwcgen[dtarx][tab];
+      }
+      ptaddr = sdwcp->ptaddr;
       if (gv.pmap32bits) {
 	pmaddr = ptaddr + 2*PAGENO(ea);
 	pte = get16mem(pmaddr);
@@ -966,14 +1599,16 @@ static pa_t mapva(ea_t ea, ea_t rp, short intacc, unsigned short *access) {
       if (!(pte & 0x8000))
 	fault(PAGEFAULT, 0, ea);
       put16mem(pmaddr, get16mem(pmaddr) | 040000);     /* set referenced bit */
+      memmove(stlbp+1, stlbp, (ways-1)*sizeof(stlbe_t));   /* drop LRU way */
       stlbp->access[0] = 7;
-      stlbp->access[1] = (sdw >> 12) & 7;
+      stlbp->access[1] = sdwcp->access[1];
       stlbp->access[STLB_UNMODIFIED_BIT] = 1;
-      stlbp->access[3] = (sdw >> 6) & 7;
+      stlbp->access[3] = sdwcp->access[3];
       stlbp->procid = getcrs16(OWNERL);
       stlbp->seg = seg;
       stlbp->ppa = ppa;
       stlbp->pmaddr = pmaddr;
+      stlbrmapadd(ppa, stlbix);
 #ifndef NOTRACE
       TRACE(T_TLB, "stlb[%d] loaded at %o/%o for %o/%o, ppn=%d\n", stlbix, RPH, RPL, seg, ea&0xFFFF, ppa>>10);
       stlbp->load_ic = gv.instcount;
@@ -992,6 +1627,7 @@ static pa_t mapva(ea_t ea, ea_t rp, short intacc, unsigned short *access) {
 	TRACE(T_TLB, "iotlb[%d] loaded at %o/%o for %o/%o, ppn=%d\n", stlbix, RPH, RPL, seg, ea&0xFFFF, ppa>>10);
       }
     }
+stlbhit:
 #if 0
     /* seems like ea ring should always be = rp ring, but not true */
     if ((rp & RINGMASK32) != (ea & RINGMASK32))
@@ -1046,6 +1682,90 @@ static unsigned int mapio(ea_t ea) {
 }
 
 
+/* maps ea through the htlb for an access from ring rp, returning
+   the htlb entry.  On a miss, or a write without write access, mapva
+   does the work (and faults if necessary) and the entry is loaded.
+   mapva leaves the STLB entry it used in way 0 of the set, so the
+   page map pointer and unmodified bit are taken from there.  Without
+   segmentation there is no page map and everything is accessible */
+
+static inline htlbe_t *htlbmap(ea_t ea, ea_t rp, short intacc) {
+  htlbe_t *hp;
+  stlbe_t *stlbp;
+  ea_t tag;
+  pa_t pa;
+  unsigned short access;
+
+  tag = (ea & 0x0FFFFC00) | ((rp | ea) & RINGMASK32) | htlbgen;
+  hp = htlb + HTLBIX(ea);
+  if (hp->tag == tag && (intacc == RACC || (hp->access & WACC) == WACC)) {
+    if (intacc == WACC && !hp->modified) {
+      put16mem(hp->pmaddr, get16mem(hp->pmaddr) & ~020000);
+      hp->modified = 1;
+    }
+    return hp;
+  }
+  pa = mapva(ea, rp, intacc, &access);
+  hp->memp = MEM + (pa & 0xFFFFFC00);
+  if (pa < gv.memlimit)
+    htlbpage[pa >> 10] = htlbgen;
+  if (getcrs16(MODALS) & 4) {
+    stlbp = STLBSETP(STLBSET(ea));
+    hp->pmaddr = stlbp->pmaddr;
+    hp->modified = !stlbp->access[STLB_UNMODIFIED_BIT];
+    hp->access = access;
+  } else {
+    hp->modified = 1;
+    hp->access = 7;
+  }
+  hp->tag = tag;
+  return hp;
+}
+
+/* physical address of ea, through the htlb */
+
+static inline pa_t htlbpa(ea_t ea, ea_t rp, short intacc) {
+
+  return (htlbmap(ea, rp, intacc)->memp - MEM) | (ea & 0x3FF);
+}
+
+/* looks up ea in the htlb without loading or faulting, returning
+   the entry if the page is mapped for ring rp, otherwise NULL.  The
+   htlb is only loaded for reads and writes, so a gate-only page is
+   never found here */
+
+static inline htlbe_t *htlbprobe(ea_t ea, ea_t rp) {
+  htlbe_t *hp;
+
+  hp = htlb + HTLBIX(ea);
+  if (hp->tag == ((ea & 0x0FFFFC00) | ((rp | ea) & RINGMASK32) | htlbgen))
+    return hp;
+  return NULL;
+}
+
+/* loads a brp entry for ea from the htlb */
+
+static inline void brpload(brp_t *bp, ea_t ea, short intacc) {
+  htlbe_t *hp;
+
+  hp = htlbmap(ea, RP, intacc);
+  bp->memp = hp->memp;
+  bp->pmaddr = hp->pmaddr;
+  bp->modified = hp->modified;
+  bp->vpn = (ea & 0x0FFFFC00) | (hp->access << 28);
+}
+
+/* the first store through a brp entry clears the page map's
+   unmodified bit.  The STLB entry isn't changed, so mapva may clear
+   the bit again later, which is harmless */
+
+static inline void brpmodify(brp_t *bp) {
+
+  put16mem(bp->pmaddr, get16mem(bp->pmaddr) & ~020000);
+  bp->modified = 1;
+}
+
+
 /* these are I/O versions of get/put that use the IOTLB rather than
    the STLB */
 
@@ -1089,14 +1809,12 @@ static unsigned int mapio(ea_t ea) {
    (only the ring part is used from this address).
 
    VERY IMPORTANT: get16r _cannot_ use the supercache!  You don't want to 
-   cache Ring 0 accesses to data, then let Ring 3 use the cache!  It could
-   be changed to use a special R0 brp cache entry, but probably not much
-   gain performance-wise.  Might speed up process exchange...
+   cache Ring 0 accesses to data, then let Ring 3 use the cache!  It uses
+   the htlb instead, which has the ring in its tag.
 */
 
 
 static inline unsigned short get16(ea_t ea) {
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1116,12 +1834,11 @@ static inline unsigned short get16(ea_t ea) {
 #ifndef NOTRACE
     gv.supermisses++;
 #endif
-    eap->memp = MEM + (mapva(ea, RP, RACC, &access) & 0xFFFFFC00);
-    eap->vpn = ea & 0x0FFFFC00;
+    brpload(eap, ea, RACC);
     return swap16(eap->memp[ea & 0x3FF]);
   }
 #else
-  return get16mem(mapva(ea, RP, RACC, &access));
+  return get16mem(htlbpa(ea, RP, RACC));
 #endif
 }
 
@@ -1151,7 +1868,6 @@ static inline unsigned short get16t(ea_t ea) {
 }
 
 static unsigned short get16r(ea_t ea, ea_t rpring) {
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1168,13 +1884,12 @@ static unsigned short get16r(ea_t ea, ea_t rpring) {
 
   if (((rpring ^ RP) & RINGMASK32) == 0)
     return get16(ea);
-  return get16mem(mapva(ea, rpring, RACC, &access));
+  return get16mem(htlbpa(ea, rpring, RACC));
 }
 
 /* get32m always uses the map and isn't inlined */
 
 static unsigned int get32m(ea_t ea) {
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1187,8 +1902,7 @@ static unsigned int get32m(ea_t ea) {
   gv.supermisses++;
 #endif
   if ((ea & 01777) <= 01776) {
-    eap->memp = MEM + (mapva(ea, RP, RACC, &access) & 0xFFFFFC00);
-    eap->vpn = ea & 0x0FFFFC00;
+    brpload(eap, ea, RACC);
     return swap32(*(unsigned int *)&eap->memp[ea & 0x3FF]);
   }
   return (get16(ea) << 16) | get16(INCVA(ea,1));
@@ -1220,7 +1934,6 @@ static inline unsigned int get32(ea_t ea) {
 
 static unsigned int get32r(ea_t ea, ea_t rpring) {
   pa_t pa;
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1234,7 +1947,7 @@ static unsigned int get32r(ea_t ea, ea_t rpring) {
   if (((rpring ^ RP) & RINGMASK32) == 0)
     return get32(ea);
 
-  pa = mapva(ea, rpring, RACC, &access);
+  pa = htlbpa(ea, rpring, RACC);
   if ((pa & 01777) <= 01776)
     return get32mem(pa);
   return (swap16(MEM[pa]) << 16) | get16r(INCVA(ea,1), rpring);
@@ -1242,7 +1955,6 @@ static unsigned int get32r(ea_t ea, ea_t rpring) {
 
 static long long get64r(ea_t ea, ea_t rpring) {
   pa_t pa, pa2;
-  unsigned short access;
   long long m;
 
   /* check for live register access */
@@ -1254,23 +1966,23 @@ static long long get64r(ea_t ea, ea_t rpring) {
   }
 #endif
 
-  pa = mapva(ea, rpring, RACC, &access);
+  pa = htlbpa(ea, rpring, RACC);
   if ((ea & 01777) <= 01774)          /* no page wrap */
     return get64mem(pa);
   switch (ea & 3) {                  /* wraps page (maybe seg too) */
   case 1:
-    pa2 = mapva(INCVA(ea,3), rpring, RACC, &access);
+    pa2 = htlbpa(INCVA(ea,3), rpring, RACC);
     m = (((long long) get16mem(pa)) << 48) +
       (((long long) get32mem(pa+1)) << 16) +
       get16mem(pa2);
     break;
   case 2:
-    pa2 = mapva(INCVA(ea,2), rpring, RACC, &access);
+    pa2 = htlbpa(INCVA(ea,2), rpring, RACC);
     m = (((long long) get32mem(pa)) << 32) +
       get32mem(pa2);
     break;
   case 3:
-    pa2 = mapva(INCVA(ea,1), rpring, RACC, &access);
+    pa2 = htlbpa(INCVA(ea,1), rpring, RACC);
     m = (((long long) get16mem(pa)) << 48) +
       (((long long) get32mem(pa2)) << 16) +
       get16mem(pa2+2);
@@ -1304,11 +2016,9 @@ static long long get64r(ea_t ea, ea_t rpring) {
 #ifdef FAST
 
 unsigned short iget16t(ea_t ea) {
-  unsigned short access;
 
   if (*(int *)&ea >= 0) {
-    gv.brp[RPBR].memp = MEM + (mapva(ea, RP, RACC, &access) & 0xFFFFFC00);
-    gv.brp[RPBR].vpn = ea & 0x0FFFFC00;
+    brpload(&gv.brp[RPBR], ea, RACC);
     return swap16(gv.brp[RPBR].memp[ea & 0x3FF]);
   }
   return get16trap(ea);
@@ -1328,7 +2038,6 @@ static inline unsigned short iget16(ea_t ea) {
 #endif
 
 static inline void put16(unsigned short value, ea_t ea) {
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1348,22 +2057,24 @@ static inline void put16(unsigned short value, ea_t ea) {
 
   if ((ea & 0x0FFFFC00) == (eap->vpn & 0x0FFFFFFF) && (eap->vpn & 0x10000000)) {
     TRACE(T_MAP, "    put16: cached %o/%o [%s]\n", ea>>16, ea&0xFFFF, brp_name());
+    if (!eap->modified)
+      brpmodify(eap);
+    pdcinvword(eap->memp - MEM + (ea & 0x3FF));
     eap->memp[ea & 0x3FF] = swap16(value);
   } else {
 #ifndef NOTRACE
     gv.supermisses++;
 #endif
-    eap->memp = MEM + (mapva(ea, RP, WACC, &access) & 0xFFFFFC00);
-    eap->vpn = (ea & 0x0FFFFC00) | (access << 28);
+    brpload(eap, ea, WACC);
+    pdcinvword(eap->memp - MEM + (ea & 0x3FF));
     eap->memp[ea & 0x3FF] = swap16(value);
   }
 #else
-  put16mem(mapva(ea, RP, WACC, &access), value);
+  put16mem(htlbpa(ea, RP, WACC), value);
 #endif
 }
 
 static void put16r(unsigned short value, ea_t ea, ea_t rpring) {
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1379,7 +2090,7 @@ static void put16r(unsigned short value, ea_t ea, ea_t rpring) {
     return;
   }
 
-  put16mem(mapva(ea, rpring, WACC, &access), value);
+  put16mem(htlbpa(ea, rpring, WACC), value);
 }
 
 /* put16trap handles stores that ARE address traps */
@@ -1416,7 +2127,6 @@ static inline void put16t(unsigned short value, ea_t ea) {
 
 
 static void put32(unsigned int value, ea_t ea) {
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1431,13 +2141,18 @@ static void put32(unsigned int value, ea_t ea) {
   if ((ea & 01777) <= 01776) {
     if ((ea & 0x0FFFFC00) == (eap->vpn & 0x0FFFFFFF) && (eap->vpn & 0x10000000)) {
       TRACE(T_MAP, "    put32: cached %o/%o [%s]\n", ea>>16, ea&0xFFFF, brp_name());
+      if (!eap->modified)
+	brpmodify(eap);
+      pdcinvword(eap->memp - MEM + (ea & 0x3FF));
+      pdcinvword(eap->memp - MEM + (ea & 0x3FF) + 1);
       *(unsigned int *)&eap->memp[ea & 0x3FF] = swap32(value);
     } else {
 #ifndef NOTRACE
       gv.supermisses++;
 #endif
-      eap->memp = MEM + (mapva(ea, RP, WACC, &access) & 0xFFFFFC00);
-      eap->vpn = (ea & 0x0FFFFC00) | (access << 28);
+      brpload(eap, ea, WACC);
+      pdcinvword(eap->memp - MEM + (ea & 0x3FF));
+      pdcinvword(eap->memp - MEM + (ea & 0x3FF) + 1);
       *(unsigned int *)&eap->memp[ea & 0x3FF] = swap32(value);
     }
   } else {
@@ -1448,7 +2163,6 @@ static void put32(unsigned int value, ea_t ea) {
 
 static void put32r(unsigned int value, ea_t ea, ea_t rpring) {
   pa_t pa;
-  unsigned short access;
 
 #ifdef DBG
   if (ea & 0x80000000) {
@@ -1464,7 +2178,7 @@ static void put32r(unsigned int value, ea_t ea, ea_t rpring) {
     return;
   }
 
-  pa = mapva(ea, rpring, WACC, &access);
+  pa = htlbpa(ea, rpring, WACC);
   if ((pa & 01777) <= 01776)
     put32mem(pa, value);
   else {
@@ -1475,7 +2189,6 @@ static void put32r(unsigned int value, ea_t ea, ea_t rpring) {
 
 static void put64r(long long value, ea_t ea, ea_t rpring) {
   pa_t pa;
-  unsigned short access;
 
   /* check for live register access */
 
@@ -1486,7 +2199,7 @@ static void put64r(long long value, ea_t ea, ea_t rpring) {
   }
 #endif
 
-  pa = mapva(ea, rpring, WACC, &access);
+  pa = htlbpa(ea, rpring, WACC);
   if ((pa & 01777) <= 01774)
     put64mem(pa, value);
   else {
@@ -1589,11 +2302,11 @@ static int rtq(ea_t qcbea, unsigned short *qent, ea_t rp) {
   qmask = get16r(qcbea+3, rp);
   qentea = MAKEVA(qseg & 0xfff, qtop);
   if (qseg & 0x8000)        /* virtual queue */
-    *qent = swap16(get16r(qentea, rp));
+    *qent = get16r(qentea, rp);
   else {
     RESTRICTR(rp);
     /* XXX: this should probably go through mapio */
-    *qent = swap16(get16mem(qentea));
+    *qent = get16mem(qentea);
   }
   qtop = (qtop & ~qmask) | ((qtop+1) & qmask);
   put16r(qtop, qcbea, rp);
@@ -1643,7 +2356,7 @@ static int rbq(ea_t qcbea, unsigned short *qent, ea_t rp) {
   qmask = get16(qcbea+3);
   qbot = (qbot & ~qmask) | ((qbot-1) & qmask);
   qentea = MAKEVA(qseg,qbot);
-  *qent = swap16(get16(qentea));
+  *qent = get16(qentea);
   put16(qbot, qcbea+1);
   return 1;
 }
@@ -1677,9 +2390,140 @@ static unsigned short tstq(ea_t qcbea) {
   return (qbot-qtop) & qmask;
 }
 
-/* devpoll: number of instructions until device poll */
+/* device poll queue.  Devices ask to be polled (called with class 4)
+   some number of instructions from now with setdevpoll; 0 cancels the
+   poll.  Pending polls are kept in a min-heap ordered by the absolute
+   instruction count they are due at, and gv.nextpoll caches the top
+   of the heap, so the fetch loop only does one compare per
+   instruction.  Deadlines are compared as signed differences so that
+   instcount wrapping is harmless. */
+
+static unsigned int devdue[64];          /* instcount when poll is due */
+static unsigned char devheap[64];        /* heap of device numbers */
+static unsigned char devhix[64];         /* device's heap index+1, 0 if idle */
+static int devheapn;                     /* # of devices in the heap */
+
+/* devpollasync is the only safe way to request a poll from a signal
+   handler or the disk I/O thread: it doesn't touch the heap or
+   gv.nextpoll, it just flags the device.  The flags are checked by
+   devsetnext and every TIMERMASK+1 instructions by the fetch loop */
+
+static volatile sig_atomic_t devkick[64], devkicked;
+
+#define DEVDUEBEFORE(d1,d2) ((int)(devdue[d1] - devdue[d2]) < 0)
+
+static void devheapplace(int hx, int device) {
+  devheap[hx] = device;
+  devhix[device] = hx+1;
+}
+
+static void devheapup(int hx) {
+  int device, px;
+
+  device = devheap[hx];
+  while (hx > 0) {
+    px = (hx-1)/2;
+    if (!DEVDUEBEFORE(device, devheap[px]))
+      break;
+    devheapplace(hx, devheap[px]);
+    hx = px;
+  }
+  devheapplace(hx, device);
+}
+
+static void devheapdown(int hx) {
+  int device, cx;
+
+  device = devheap[hx];
+  while ((cx = 2*hx+1) < devheapn) {
+    if (cx+1 < devheapn && DEVDUEBEFORE(devheap[cx+1], devheap[cx]))
+      cx++;
+    if (!DEVDUEBEFORE(devheap[cx], device))
+      break;
+    devheapplace(hx, devheap[cx]);
+    hx = cx;
+  }
+  devheapplace(hx, device);
+}
+
+static void devheapdel(int device) {
+  int hx, last;
+
+  hx = devhix[device]-1;
+  devhix[device] = 0;
+  if (hx == --devheapn)
+    return;
+  last = devheap[devheapn];
+  devheapplace(hx, last);
+  devheapdown(hx);
+  devheapup(devhix[last]-1);
+}
+
+/* when nothing is queued, park nextpoll far enough ahead that it
+   won't be reached before something is */
+
+static inline void devsetnext() {
+  if (devkicked)
+    gv.nextpoll = gv.instcount;
+  else if (devheapn > 0)
+    gv.nextpoll = devdue[devheap[0]];
+  else
+    gv.nextpoll = gv.instcount + 0x40000000;
+}
+
+static void setdevpoll(int device, int ninst) {
+  if (devhix[device])
+    devheapdel(device);
+  if (ninst != 0) {
+    if (ninst < 0)
+      ninst = 1;
+    devdue[device] = gv.instcount + ninst;
+    devheapplace(devheapn, device);
+    devheapup(devheapn++);
+  }
+  devsetnext();
+}
+
+/* returns # of instructions until a device's poll, or 0 if no poll is
+   scheduled.  An overdue poll returns 1 */
+
+static int getdevpoll(int device) {
+  int ninst;
+
+  if (!devhix[device])
+    return 0;
+  ninst = devdue[device] - gv.instcount;
+  return (ninst > 0) ? ninst : 1;
+}
+
+/* returns # of instructions until the next device poll, 0 if none */
+
+static int nextdevpoll() {
+  if (devheapn == 0)
+    return 0;
+  return getdevpoll(devheap[0]);
+}
+
+static void devpollasync(int device) {
+  devkick[device] = 1;
+  devkicked = 1;
+}
+
+/* devices save their state for -snapshot with class -3 and load it
+   for -restore with class -4.  snapio writes or reads depending on
+   the class, so the same list of variables does both */
+
+static void snapio(int class, void *p, int n) {
+  if (class == -3) {
+    if (fwrite(p, 1, n, snapfp) != n) {
+      perror("Error writing snapshot file");
+      fatal(NULL);
+    }
+  } else if (fread(p, 1, n, snapfp) != n)
+    fatal("Snapshot file is truncated");
+}
 
-static int devpoll[64] = {0};
+#define SNAPVAR(class,var) snapio((class), &(var), sizeof(var))
 
 #include "emdev.h"
 
@@ -1721,34 +2565,413 @@ static int (*devmap[64])(int, int, int) = {
   /* '6x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone,
   /* '7x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone};
 
-#else
+#else
+
+/* this is a "typical system" controller configuration:
+
+   '04 = devasr: system console
+   '07 = devpnc: Primenet Node Controller aka PNC (Ringnet)
+   '14 = devmt: mag tape controller (4 drives)
+   '20 = devcp: clock / VCP / SOC
+   '26 = devdisk: 1st disk controller (8 drives)
+   '27 = devdisk: 2nd disk controller (8 drives)
+   '54 = 1st amlc (terminal) controller (16 lines)
+   '53 = devamlc: 2nd AMLC (16 lines)
+*/
+
+static int (*devmap[64])(int, int, int) = {
+  /* '0x */ devnone,devnone,devnone,devnone,devasr,devnone,devnone,devpnc,
+  /* '1x */ devnone,devnone,devnone,devnone,devmt,devnone, devnone, devnone,
+  /* '2x */ devcp,devnone,devnone,devnone,devnone,devnone,devdisk,devdisk,
+  /* '3x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone,
+  /* '4x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone,
+  /* '5x */ devnone,devnone,devnone,devamlc,devamlc,devnone,devnone,devnone,
+  /* '6x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone,
+  /* '7x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone};
+#endif
+
+/* called from the fetch loop when gv.nextpoll is reached: poll
+   devices whose time has come.  A device is removed from the heap
+   before it is polled, so the poll routine can reschedule itself */
+
+static void devpolls() {
+  int device;
+
+  if (devkicked) {
+    devkicked = 0;
+    for (device=0; device<64; device++)
+      if (devkick[device]) {
+	devkick[device] = 0;
+	devmap[device](4, 0, device);
+      }
+  }
+  while (devheapn > 0 && (int)(gv.instcount - devdue[devheap[0]]) >= 0) {
+    device = devheap[0];
+    devheapdel(device);
+    devmap[device](4, 0, device);
+  }
+  devsetnext();
+}
+
+
+/* -snapshot saves the whole machine when SIGUSR1 arrives, and
+   -checkpoint saves it every few minutes: registers, gv (STLB, IOTLB,
+   interrupt state, etc.), memory, pending device polls, then each
+   device's state.  -restore loads a snapshot instead of booting, so a
+   booted Primos resumes where it left off.
+
+   A snapshot only restores with the same build of the emulator, CPU
+   model, and memory size; the header checks this.  Host connections
+   (terminals, the ring network, tape files) are not saved, so the
+   restored system sees them as disconnected.  The disk controllers
+   save each drive file's inode, size, and modification time, and
+   restore refuses drive files that don't match.  In DISKSAFE builds
+   the drive files aren't written; each snapshot has the disk I/O
+   threads write back their caches and copy the overlays, so -restore
+   puts the drives back too.  Without DISKSAFE, the caches are written
+   back before the drive files' identities are saved, and since the
+   drives only change forward, -checkpoint isn't allowed.
+
+   The file is a header, the memory image at SNAPHDRSIZE (zero pages
+   are left as holes), then the rest of the state.  The header is
+   written last, so a partly written file won't restore.
+
+   Taking a snapshot only stops the emulator long enough to save the
+   registers and devices into a buffer.  Then it forks, and the child
+   writes the file from its copy-on-write image of memory while the
+   parent keeps running.  One snapshot is made at a time; another
+   request waits until it's done.  Once the child has written the file
+   and the disk overlays have been copied, the parent renames it into
+   place.
+
+   Checkpoints alternate between <file>.0 and <file>.1, and <file> is
+   a symlink to the last complete one.  If a checkpoint file or its
+   overlay copies can't be written, the next checkpoint goes to the
+   same file, so the last complete one isn't overwritten.  Stores to
+   memory mark the page in memdirty with a bit for each of these, so
+   after the first checkpoint to a file, only pages changed since its
+   previous checkpoint are written. */
+
+#define SNAPMAGIC 0x50454D53           /* "PEMS" */
+#define SNAPVERSION 2
+#define SNAPHDRSIZE 4096               /* memory image offset */
+#define SNAPHDRWORDS 8
+
+static pid_t snappid;                  /* child writing a snapshot */
+static int snapwritten;                /* child is done, file not in place */
+static unsigned int snapic;            /* instruction # of the snapshot */
+static int ckptvalid[2];               /* checkpoint file is complete */
+static int ckptslot;                   /* next checkpoint file */
+
+static void snaphdr(int *hdr, int metalen) {
+  hdr[0] = SNAPMAGIC;
+  hdr[1] = SNAPVERSION;
+  hdr[2] = sizeof(gv_t);
+  hdr[3] = sizeof(regs);
+  hdr[4] = cpuid;
+  hdr[5] = gv.memlimit;
+  hdr[6] = metalen;
+  hdr[7] = 0;
+}
+
+/* saves or restores everything but memory.  Each device's state is
+   preceded by its device number and length, so a device that isn't
+   configured on one side is skipped */
+
+static void snapstate(int class) {
+  int crsx, n, device;
+  long devpos, endpos;
+  gv_t sgv;
+
+  /* registers: crsl points into regs, so save it as an offset */
+
+  SNAPVAR(class, regs);
+  SNAPVAR(class, rpreg);
+  crsx = crsl - (unsigned int *)&regs;
+  SNAPVAR(class, crsx);
+  crsl = (unsigned int *)&regs + crsx;
+
+  /* gv: the dispatch tables are code addresses and tracing belongs to
+     this run, so those are kept.  brp has pointers into MEM */
+
+  sgv = gv;
+  SNAPVAR(class, sgv);
+  if (class == -4) {
+    memcpy(sgv.disp_rmr, gv.disp_rmr, sizeof(gv.disp_rmr));
+    memcpy(sgv.disp_vmr, gv.disp_vmr, sizeof(gv.disp_vmr));
+#ifndef NOTRACE
+    memcpy(&sgv.tracefile, &gv.tracefile, sizeof(gv_t) - offsetof(gv_t, tracefile));
+#endif
+    gv = sgv;
+    invalidate_brp();
+    pdcinvall();
+    sdwcinvall();
+    ecbcinvall();
+    pxrcinvall();
+    stlbrmapbuild();
+  }
+
+  /* pending polls, relative to instcount */
+
+  for (device=0; device<64; device++) {
+    n = getdevpoll(device);
+    SNAPVAR(class, n);
+    if (class == -4)
+      setdevpoll(device, n);
+  }
+
+  /* devices */
+
+  for (device=0; device<64; device++) {
+    n = device;
+    SNAPVAR(class, n);
+    if (n != device)
+      fatal("Snapshot file is corrupt");
+    devpos = ftell(snapfp);
+    n = 0;
+    SNAPVAR(class, n);
+    if (class == -3) {
+      devmap[device](class, 0, device);
+      endpos = ftell(snapfp);
+      n = endpos - devpos - sizeof(n);
+      fseek(snapfp, devpos, SEEK_SET);
+      SNAPVAR(class, n);
+      fseek(snapfp, endpos, SEEK_SET);
+    } else {
+      endpos = devpos + sizeof(n) + n;
+      if (n > 0 && devmap[device] == devnone)
+	fprintf(stderr, "em: device '%o in snapshot is not configured\n", device);
+      else if (n > 0) {
+	devmap[device](class, 0, device);
+	if (ftell(snapfp) != endpos) {
+	  fprintf(stderr, "em: snapshot state for device '%o is the wrong size\n", device);
+	  fatal("Unable to restore snapshot");
+	}
+      }
+      fseek(snapfp, endpos, SEEK_SET);
+    }
+  }
+}
+
+/* writes a snapshot file.  This runs in the child after fork, so it
+   sticks to system calls.  If full is set the file is rewritten,
+   otherwise only the pages with slotbit set in memdirty are */
+
+static int snapwrite(char *path, int *hdr, char *meta, int metalen, int full, int slotbit) {
+  static unsigned short zeropage[1024];
+  int zhdr[SNAPHDRWORDS];
+  int fd, pagex;
+  off_t metaoff;
+
+  if ((fd = open(path, O_RDWR | O_CREAT | (full ? O_TRUNC : 0), 0644)) == -1)
+    return -1;
+  memset(zhdr, 0, sizeof(zhdr));
+  if (pwrite(fd, zhdr, sizeof(zhdr), 0) != sizeof(zhdr))
+    goto fail;
+  for (pagex=0; pagex < gv.memlimit/1024; pagex++)
+    if (full ? memcmp(MEM+pagex*1024, zeropage, sizeof(zeropage)) != 0 : (memdirty[pagex] & slotbit))
+      if (pwrite(fd, MEM+pagex*1024, sizeof(zeropage), SNAPHDRSIZE + (off_t)pagex*sizeof(zeropage)) != sizeof(zeropage))
+	goto fail;
+  metaoff = SNAPHDRSIZE + (off_t)gv.memlimit*2;
+  if (pwrite(fd, meta, metalen, metaoff) != metalen || ftruncate(fd, metaoff+metalen) == -1 || fsync(fd) == -1)
+    goto fail;
+  if (pwrite(fd, hdr, SNAPHDRWORDS*sizeof(int), 0) != SNAPHDRWORDS*sizeof(int) || fsync(fd) == -1)
+    goto fail;
+  return close(fd);
+
+fail:
+  close(fd);
+  return -1;
+}
+
+/* starts writing the -snapshot file (slot -1) or a checkpoint file */
+
+static void snapsave(int slot) {
+  char *meta;
+  size_t metalen;
+  int hdr[SNAPHDRWORDS];
+  char path[MAXPATHLEN];
+  int full, slotbit, pagex;
+  pid_t pid;
+
+  snapslot = slot;
+  snapcopyfail = 0;
+  if ((snapfp = open_memstream(&meta, &metalen)) == NULL) {
+    perror("Unable to save snapshot state");
+    fatal(NULL);
+  }
+  snapstate(-3);
+  if (fclose(snapfp) != 0)
+    fatal("Unable to save snapshot state");
+  snapfp = NULL;
+  snaphdr(hdr, metalen);
+
+  if (slot < 0) {
+    snprintf(path, sizeof(path), "%s.tmp", snapfile);
+    full = 1;
+    slotbit = 0;
+  } else {
+    snprintf(path, sizeof(path), "%s.%d", ckptfile, slot);
+    full = !ckptvalid[slot];
+    slotbit = 1 << slot;
+  }
+
+  if ((pid = fork()) == 0) {
+    if (snapwrite(path, hdr, meta, metalen, full, slotbit) == -1) {
+      perror(path);
+      _exit(1);
+    }
+    _exit(0);
+  }
+  free(meta);
+  if (pid == -1) {
+    perror("Unable to fork to write snapshot");
+    return;
+  }
+  snappid = pid;
+  snapic = gv.instcount;
+  if (slot >= 0) {
+    ckptvalid[slot] = 1;
+    for (pagex=0; pagex < gv.memlimit/1024; pagex++)
+      memdirty[pagex] &= ~slotbit;
+  }
+}
+
+/* a snapshot that couldn't be made: a checkpoint file is rewritten in
+   full next time, and the next checkpoint goes to it again */
+
+static void snapfailed() {
+
+  fprintf(stderr, "em: unable to write %s\n", (snapslot < 0) ? snapfile : ckptfile);
+  if (snapslot >= 0) {
+    ckptvalid[snapslot] = 0;
+    ckptslot = snapslot;
+  }
+}
+
+/* puts a finished snapshot in place: renames the -snapshot file, or
+   links <file> to the checkpoint file */
+
+static void snapfinish() {
+  char path[MAXPATHLEN], linkpath[MAXPATHLEN], *target;
+
+  if (snapslot < 0) {
+    snprintf(path, sizeof(path), "%s.tmp", snapfile);
+    if (rename(path, snapfile) == -1) {
+      perror(snapfile);
+      snapfailed();
+    } else
+      fprintf(stderr, "em: snapshot written to %s at instruction #%u\n", snapfile, snapic);
+    return;
+  }
+  snprintf(path, sizeof(path), "%s.%d", ckptfile, snapslot);
+  snprintf(linkpath, sizeof(linkpath), "%s.tmp", ckptfile);
+  if ((target = strrchr(path, '/')) != NULL)
+    target++;
+  else
+    target = path;
+  unlink(linkpath);
+  if (symlink(target, linkpath) == -1 || rename(linkpath, ckptfile) == -1) {
+    perror(ckptfile);
+    snapfailed();
+  }
+}
+
+/* called from the fetch loop when a snapshot or checkpoint is wanted,
+   or to reap the child writing one.  The snapshot is put in place
+   once the child is done and the disk I/O threads have copied the
+   overlays for it */
+
+static void snapcheck() {
+  int status;
+  pid_t pid;
+
+  if (snappid > 0) {
+    if ((pid = waitpid(snappid, &status, WNOHANG)) == 0)
+      return;                            /* still writing */
+    if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      snapfailed();
+    else
+      snapwritten = 1;
+    snappid = 0;
+  }
+  if (snapcopies > 0)
+    return;                              /* still copying overlays */
+  if (snapwritten) {
+    snapwritten = 0;
+    if (snapcopyfail)
+      snapfailed();
+    else
+      snapfinish();
+  }
+  if (snapwanted) {
+    snapwanted = 0;
+    if (snapfile)
+      snapsave(-1);
+    else
+      fprintf(stderr, "em: SIGUSR1 ignored: no -snapshot file\n");
+  } else if (ckptwanted) {
+    ckptwanted = 0;
+    snapsave(ckptslot);
+    ckptslot ^= 1;
+  }
+}
+
+static void snaprestore(char *path) {
+  int hdr[SNAPHDRWORDS], shdr[SNAPHDRWORDS];
+  int fd;
+  off_t off, hole, memend;
 
-/* this is a "typical system" controller configuration:
+  if ((snapfp = fopen(path, "r")) == NULL) {
+    perror("Unable to open snapshot file");
+    fatal(NULL);
+  }
+  SNAPVAR(-4, shdr);
+  snaphdr(hdr, shdr[6]);
+  if (shdr[0] == 0)
+    fatal("Snapshot file is incomplete");
+  if (shdr[0] != hdr[0] || shdr[1] != hdr[1])
+    fatal("Not an emulator snapshot file");
+  if (shdr[2] != hdr[2] || shdr[3] != hdr[3])
+    fatal("Snapshot was taken by a different build of the emulator");
+  if (shdr[4] != hdr[4] || shdr[5] != hdr[5])
+    fatal("Snapshot was taken with a different -cpuid or -mem");
+
+  /* only read the parts of the memory image that aren't holes, so
+     memory that was never touched stays uncommitted */
+
+  memend = SNAPHDRSIZE + (off_t)gv.memlimit*2;
+#ifdef SEEK_DATA
+  fd = fileno(snapfp);
+  for (off = SNAPHDRSIZE; off < memend; off = hole) {
+    if ((off = lseek(fd, off, SEEK_DATA)) == -1 || off >= memend)
+      break;
+    if ((hole = lseek(fd, off, SEEK_HOLE)) == -1 || hole > memend)
+      hole = memend;
+    if (pread(fd, (char *)MEM + (off - SNAPHDRSIZE), hole - off, off) != hole - off)
+      fatal("Snapshot file is truncated");
+  }
+#else
+  fseek(snapfp, SNAPHDRSIZE, SEEK_SET);
+  snapio(-4, MEM, gv.memlimit*2);
+#endif
+  fseek(snapfp, memend, SEEK_SET);
+  snapstate(-4);
+  fclose(snapfp);
+  snapfp = NULL;
+}
 
-   '04 = devasr: system console
-   '07 = devpnc: Primenet Node Controller aka PNC (Ringnet)
-   '14 = devmt: mag tape controller (4 drives)
-   '20 = devcp: clock / VCP / SOC
-   '26 = devdisk: 1st disk controller (8 drives)
-   '27 = devdisk: 2nd disk controller (8 drives)
-   '54 = 1st amlc (terminal) controller (16 lines)
-   '53 = devamlc: 2nd AMLC (16 lines)
-*/
+static void snapsignal(int sig) {
+  snapwanted = 1;
+}
 
-static int (*devmap[64])(int, int, int) = {
-  /* '0x */ devnone,devnone,devnone,devnone,devasr,devnone,devnone,devpnc,
-  /* '1x */ devnone,devnone,devnone,devnone,devmt,devnone, devnone, devnone,
-  /* '2x */ devcp,devnone,devnone,devnone,devnone,devnone,devdisk,devdisk,
-  /* '3x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone,
-  /* '4x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone,
-  /* '5x */ devnone,devnone,devnone,devamlc,devamlc,devnone,devnone,devnone,
-  /* '6x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone,
-  /* '7x */ devnone,devnone,devnone,devnone,devnone,devnone,devnone,devnone};
-#endif
+static void ckptsignal(int sig) {
+  ckptwanted = 1;
+}
 
 
 static void warn(char *msg) {
-  printf("emulator warning:\n  instruction #%u at %o/%o: %o %o keys=%o, modals=%o\n  %s\n", gv.instcount, gv.prevpc >> 16, gv.prevpc & 0xFFFF, get16t(gv.prevpc), get16t(gv.prevpc+1),getcrs16(KEYS), getcrs16(MODALS), msg);
+  printf("emulator warning:\n  instruction #%u at %o/%o: %o %o keys=%o, modals=%o\n  %s\n", gv.instcount, gv.prevpc >> 16, gv.prevpc & 0xFFFF, get16t(gv.prevpc), get16t(gv.prevpc+1),getkeys(), getcrs16(MODALS), msg);
 }
     
 
@@ -1870,7 +3093,7 @@ static void fatal(char *msg) {
   printf("\n");
   
   if (physmem != NULL) {
-    printf("instruction #%u at %o/%o %s ^%06o^\nA='%o/%d  B='%o/%d  L='%o/%d  X='%o/%d K=%o [%s]\nowner=%o %s, modals=%o [%s]\n", gv.instcount, gv.prevpc >> 16, gv.prevpc & 0xFFFF, searchloadmap(gv.prevpc,' '), lights, getcrs16(A), getcrs16s(A), getcrs16(B), getcrs16s(B), getcrs32(A), getcrs32s(A), getcrs16(X), getcrs16s(X), getcrs16(KEYS), keystring(getcrs16(KEYS)), getcrs16(OWNERL), searchloadmap(getcrs32(OWNER),' '), getcrs16(MODALS), modstring(getcrs16(MODALS)));
+    printf("instruction #%u at %o/%o %s ^%06o^\nA='%o/%d  B='%o/%d  L='%o/%d  X='%o/%d K=%o [%s]\nowner=%o %s, modals=%o [%s]\n", gv.instcount, gv.prevpc >> 16, gv.prevpc & 0xFFFF, searchloadmap(gv.prevpc,' '), lights, getcrs16(A), getcrs16s(A), getcrs16(B), getcrs16s(B), getcrs32(A), getcrs32s(A), getcrs16(X), getcrs16s(X), getkeys(), keystring(getkeys()), getcrs16(OWNERL), searchloadmap(getcrs32(OWNER),' '), getcrs16(MODALS), modstring(getcrs16(MODALS)));
 
     /* dump concealed stack entries */
 
@@ -1899,10 +3122,12 @@ static void fatal(char *msg) {
 	break;
     }
     printf("\n");
-    printf("STLB calls: %d  misses: %d  hitrate: %5.2f%%\n", gv.mapvacalls, gv.mapvamisses, (double)(gv.mapvacalls-gv.mapvamisses)/gv.mapvacalls*100.0);
     printf("Supercache calls: %d  misses: %d  hitrate: %5.2f%%\n", gv.supercalls, gv.supermisses, (double)(gv.supercalls-gv.supermisses)/gv.supercalls*100.0);
 #endif
 
+    if (gv.mapvacalls > 0)
+      printf("STLB %dx%d calls: %llu  misses: %llu  hitrate: %5.2f%%\n", gv.stlbsetmask+1, 1 << gv.stlbwshift, gv.mapvacalls, gv.mapvamisses, (double)(gv.mapvacalls-gv.mapvamisses)/gv.mapvacalls*100.0);
+
     /* should do a register dump, RL dump, PCB dump, etc. here... */
 
     /* call all devices with a request to terminate */
@@ -1955,7 +3180,7 @@ static void newkeys (unsigned short new) {
     warn("Invalid CPU mode");
     fault(ILLINSTFAULT, RPL, RP);
   }
-  putcrs16(KEYS, new);
+  putkeys(new);
 }
 
 static void fault(unsigned short fvec, unsigned short fcode, ea_t faddr) {
@@ -1989,7 +3214,7 @@ static void fault(unsigned short fvec, unsigned short fcode, ea_t faddr) {
   /* save RP, keys in regfile, fcode and faddr in crs */
 
   putar32(PSWPB32, faultrp);
-  regs.sym.pswkeys = crs[KEYS];   /* Prime->Prime: no swap! */
+  putar16(PSWKEYS16, getkeys());
   putcrs16(FCODE, fcode);
   putcrs32(FADDR, faddr);
   
@@ -2030,7 +3255,7 @@ static void fault(unsigned short fvec, unsigned short fcode, ea_t faddr) {
     }
     csea = MAKEVA(getcrs16(OWNERH)+gv.csoffset, next);
     put32r0(faultrp, csea);
-    put16r0(getcrs16(KEYS), csea+2);
+    put16r0(getkeys(), csea+2);
     put16r0(fcode, csea+3);
     put32r0(faddr, csea+4);
     put16r0(next+6, pcbp+PCBCSNEXT);
@@ -2427,7 +3652,7 @@ static ea_t apea(unsigned short *bitarg) {
 
 static inline void mathexception(unsigned char extype, unsigned short fcode, ea_t faddr)
 {
-  putcrs16(KEYS, getcrs16(KEYS) | 0x8000);
+  putkeys(getkeys() | 0x8000);
   switch (extype) {
   case 'i':
     if (getcrs16(KEYS) & 0400) 
@@ -2458,7 +3683,7 @@ static void dumpregs() {
   for (rs=0; rs<REGSETS; rs++) {
     TRACEA("Register set %d:\n", rs);
     for (i=0; i<32; i++) {
-      val = swap32(regs.rs[rs][i]);
+      val = regs.rs[rs][i];
       v1 = val >> 16;
       v2 = val & 0xFFFF;
       TRACEA("'%02o: %06o %06o  %04x %04x\n", i, v1, v2, v1, v2);
@@ -2814,6 +4039,9 @@ static void pcl (ea_t ecbea) {
   short i,j;
   unsigned short access;
   unsigned short ecb[9];
+  ecbce_t *ecbp;              /* decoded ecb */
+  ecbce_t ecbd;               /* copy of decoded ecb */
+  htlbe_t *hp;
   ea_t newrp;                 /* start of new proc */
   ea_t ea;
   short stackrootseg, stackseg;
@@ -2823,6 +4051,7 @@ static void pcl (ea_t ecbea) {
   pa_t pa;                    /* physical address of ecb */
   unsigned short brsave[6];   /* old PB,SB,LB */
   unsigned short utempa;
+  pa_t fppa;                  /* physical address of new stack frame */
 
 #define UNWIND_ MAKEVA(013,0106577)
 
@@ -2843,31 +4072,60 @@ static void pcl (ea_t ecbea) {
   if (RPL == 0)      /* did RP wrap? */
     RP -= (1<<16);   /* yes, subtract 1 from seg # */
 
-  /* get segment access; mapva ensures either read or gate */
+  /* get segment access; mapva ensures either read or gate.  If the
+     ecb page is in the htlb for this ring, it's readable */
 
-  pa = mapva(ecbea, RP, PACC, &access);
+  if ((hp = htlbprobe(ecbea, RP)) != NULL) {
+    pa = (hp->memp - MEM) | (ecbea & 0x3FF);
+    access = hp->access;
+  } else
+    pa = mapva(ecbea, RP, PACC, &access);
   TRACE(T_PCL, " ecb @ %o/%o, access=%d\n", ecbea>>16, ecbea&0xFFFF, access);
 
-  /* get a copy of the ecb.  gates must be aligned on a 16-word
+  /* get the decoded ecb.  gates must be aligned on a 16-word
      boundary, therefore can't cross a page boundary, and mapva has
      already ensured that the ecb page is resident.  For a non-gate
-     ecb, check to see if it crosses a page boundary.  If not, a 
-     memcpy is okay; if it does, do fetches */
+     ecb, check to see if it crosses a page boundary.  If not, it can
+     be decoded from memory and cached; if it does, do fetches */
 
   if (access == 1 && (ecbea & 0xF) != 0)
     fault(ACCESSFAULT, 0, ecbea);
-  if ((pa & 01777) <= 02000 - sizeof(ecb)/sizeof(ecb[0])) {
-    memcpy(ecb, MEM+pa, sizeof(ecb));
-    for (i=0; i<9; i++)
-      ecb[i] = swap16(ecb[i]);
-  } else {
-    for (i=0; i<9; i++)
-      ecb[i] = get16(ecbea+i);
+  ecbp = ecbc + ECBCIX(pa);
+  if (ecbp->gen != ecbcgen || ecbp->pa != pa) {
+    if ((pa & 01777) <= 02000 - sizeof(ecb)/sizeof(ecb[0])) {
+      memcpy(ecb, MEM+pa, sizeof(ecb));
+      for (i=0; i<9; i++)
+	ecb[i] = swap16(ecb[i]);
+      if (!(cachepage[pa >> 10] & CP_ECB)) {
+	if (necbpages == ECBCPAGES)
+	  ecbcinvall();
+	cachepage[pa >> 10] |= CP_ECB;
+	ecbpages[necbpages++] = pa >> 10;
+      }
+    } else {
+      for (i=0; i<9; i++)
+	ecb[i] = get16(ecbea+i);
+      ecbp = &ecbd;
+    }
+    ecbp->pb = ecb[0]<<16 | ecb[1];
+    ecbp->framesize = (ecb[2] + 1) & 0xFFFE;   /* round up to even */
+    ecbp->stackroot = ecb[3];
+    ecbp->argdisp = ecb[4];
+    ecbp->nargs = ecb[5];
+    ecbp->lb = (ecb[6]<<16) | ecb[7];
+    ecbp->keys = ecb[8];
+    ecbp->pa = pa;
+    ecbp->gen = ecbcgen;
   }
 
-  TRACE(T_PCL, " ecb.pb: %o/%o\n ecb.framesize: %d\n ecb.stackroot %o\n ecb.argdisp: %o\n ecb.nargs: %d\n ecb.lb: %o/%o\n ecb.keys: %o\n", ecb[0], ecb[1], ecb[2], ecb[3], ecb[4], ecb[5], ecb[6], ecb[7], ecb[8]);
+  /* the stack stores below could drop the cache entry */
+
+  ecbd = *ecbp;
+  ecbp = &ecbd;
 
-  newrp = ecb[0]<<16 | ecb[1];
+  TRACE(T_PCL, " ecb.pb: %o/%o\n ecb.framesize: %d\n ecb.stackroot %o\n ecb.argdisp: %o\n ecb.nargs: %d\n ecb.lb: %o/%o\n ecb.keys: %o\n", ecbp->pb>>16, ecbp->pb&0xFFFF, ecbp->framesize, ecbp->stackroot, ecbp->argdisp, ecbp->nargs, ecbp->lb>>16, ecbp->lb&0xFFFF, ecbp->keys);
+
+  newrp = ecbp->pb;
   if (access != 1)    /* not a gate, so weaken ring (outward calls) */
     newrp = newrp | (RP & RINGMASK32);
 
@@ -2879,8 +4137,8 @@ static void pcl (ea_t ecbea) {
      NOTE: see related code in STEX and PRTN.
   */
 
-  framesize = (ecb[2] + 1) & 0xFFFE;   /* round up frame size to even */
-  stackrootseg = ecb[3];
+  framesize = ecbp->framesize;
+  stackrootseg = ecbp->stackroot;
   eap = &gv.brp[SBBR];
   if (stackrootseg == 0) {
     stackrootseg = get16((getcrs32(SB)) + 1);
@@ -2914,22 +4172,34 @@ static void pcl (ea_t ecbea) {
 
      NOTE: Ring must be added to stackfp so that any page faults that
      occur while setting up the stack will have the correct ring for
-     CPU.PCL tests */
+     CPU.PCL tests.  If the 10-word header is in one page, it only
+     has to be mapped once. */
 
   stackfp |= (newrp & RINGMASK32);
-  put16r(0, stackfp, newrp);
-  put16r(stackrootseg, stackfp+1, newrp);
-  put32r(RP, stackfp+2, newrp);
-  put32r(getcrs32(SB), stackfp+4, newrp);
-  put32r(getcrs32(LB), stackfp+6, newrp);
-  put16r(getcrs16(KEYS), stackfp+8, newrp);
-  put16r(RPL, stackfp+9, newrp);
+  if ((stackfp & 01777) <= 02000 - 10) {
+    fppa = htlbpa(stackfp, newrp, WACC);
+    put16mem(fppa, 0);
+    put16mem(fppa+1, stackrootseg);
+    put32mem(fppa+2, RP);
+    put32mem(fppa+4, getcrs32(SB));
+    put32mem(fppa+6, getcrs32(LB));
+    put16mem(fppa+8, getkeys());
+    put16mem(fppa+9, RPL);
+  } else {
+    put16r(0, stackfp, newrp);
+    put16r(stackrootseg, stackfp+1, newrp);
+    put32r(RP, stackfp+2, newrp);
+    put32r(getcrs32(SB), stackfp+4, newrp);
+    put32r(getcrs32(LB), stackfp+6, newrp);
+    put16r(getkeys(), stackfp+8, newrp);
+    put16r(RPL, stackfp+9, newrp);
+  }
 
 #if 0
   /* LATER: save caller's base registers for address calculations, and
      pass to argt */
 
-  if (ecb[5] > 0) {
+  if (ecbp->nargs > 0) {
     brsave[0] = RPH;       brsave[1] = 0;
     brsave[2] = getcrs16(SBH);  brsave[3] = getcrs16(SBL);
     brsave[4] = getcrs16(LBH);  brsave[5] = getcrs16(LBL);
@@ -2949,8 +4219,8 @@ static void pcl (ea_t ecbea) {
     putcrs32(SB, (stackfp & ~RINGMASK32) | (newrp & RINGMASK32));
 #endif
   TRACE(T_PCL, " new SB=%o/%o\n", getcrs16(SBH), getcrs16(SBL));
-  putcrs32(LB, (ecb[6]<<16) | ecb[7]);
-  newkeys(ecb[8] & 0177770);
+  putcrs32(LB, ecbp->lb);
+  newkeys(ecbp->keys & 0177770);
 
   /* update the stack free pointer; this has to wait until after all
      memory accesses, in case of stack page faults (PCL restarts).
@@ -2992,9 +4262,9 @@ static void pcl (ea_t ecbea) {
   gv.prevpc = RP;
   TRACE(T_PCL, " new RP=%o/%o\n", RPH, RPL);
 
-  if (ecb[5] > 0) {
-    putcrs16(Y, ecb[4]);
-    putcrs16(YL, ecb[5]);
+  if (ecbp->nargs > 0) {
+    putcrs16(Y, ecbp->argdisp);
+    putcrs16(YL, ecbp->nargs);
 #if 0
     putcrs16(X, 0);
 #endif
@@ -3011,7 +4281,7 @@ static void pcl (ea_t ecbea) {
       unsigned char tnstring[500];
       unsigned short tnlen, tnword;
       unsigned char tnchar;
-      ea = getcrs32(SB) + ecb[4];
+      ea = getcrs32(SB) + ecbp->argdisp;
       utempa = get16(get32(ea));       /* 1st arg: userid */
       if (utempa == ((getcrs16(OWNERL)>>6) & 0xff)) {
 	ea = ea + 6;                   /* 3rd arg: length */
@@ -3050,7 +4320,7 @@ static void pcl (ea_t ecbea) {
       int utempl;
       unsigned short utempa,utempa1,utempa2;
 
-      ea = getcrs32(SB) + ecb[4];
+      ea = getcrs32(SB) + ecbp->argdisp;
       utempa = get16(get32(ea));       /* 1st arg: key */
       TRACEA(" TSRC$$: key = %d\n", utempa);
       eatemp = get32(ea+9);       /* 4th arg: CP(1..2) */
@@ -3192,8 +4462,26 @@ static void pxregsave(unsigned short wait) {
   }
   put16r0(mask, pcbp+PCBMASK);
   put32r0(getcrs32(TIMER), pcbp+PCBIT);  /* save interval timer */
-  putcrs16(KEYS, getcrs16(KEYS) | 1);                 /* set save done bit */
-  put16r0(getcrs16(KEYS), pcbp+PCBKEYS);
+  putkeys(getkeys() | 1);                 /* set save done bit */
+  put16r0(getkeys(), pcbp+PCBKEYS);
+
+  /* remember what pxregload will load, now that the stores are done */
+
+  if (((pcbp+PCBDTAR2) & 01777) <= 02000 - PXRCWORDS) {
+    pa_t pa;
+    pxrce_t *pxrcp;
+
+    pa = htlbpa(pcbp+PCBDTAR2, 0, RACC);
+    pxrcp = pxrc + PXRCIX(pa);
+    for (i=0; i<020; i++)
+      pxrcp->gr[i] = (mask & BITMASK16(i+1)) ? getgr32(i) : 0;
+    pxrcp->dtar2 = get32mem(pa+PCBDTAR2-PCBDTAR2);
+    pxrcp->dtar3 = get32mem(pa+PCBDTAR3-PCBDTAR2);
+    pxrcp->timer = getcrs32(TIMER);
+    pxrcp->keys = getkeys();
+    pxrcp->pa = pa;
+    cachepage[pa >> 10] |= CP_PXR;
+  }
 }
 
 /* pxregload: load pcbp's registers from their pcb to the current
@@ -3206,8 +4494,30 @@ static void pxregload (ea_t pcbp) {
   ea_t regp;
   unsigned short mask;
   int i;
+  pa_t pa;
+  pxrce_t *pxrcp;
 
   TRACE(T_PX, "pxregload loading registers for process %o/%o\n", pcbp>>16, pcbp&0xFFFF);
+
+  /* use the process register cache if the save area is in it */
+
+  pxrcp = NULL;
+  if (((pcbp+PCBDTAR2) & 01777) <= 02000 - PXRCWORDS) {
+    pa = htlbpa(pcbp+PCBDTAR2, 0, RACC);
+    pxrcp = pxrc + PXRCIX(pa);
+    if (pxrcp->pa == pa) {
+      TRACE(T_PX, "pxregload: registers are cached\n");
+      for (i=0; i<020; i++)
+	putgr32(i, pxrcp->gr[i]);
+      newkeys(pxrcp->keys);
+      putcrs32(DTAR2, pxrcp->dtar2);
+      putcrs32(DTAR3, pxrcp->dtar3);
+      putcrs32(TIMER, pxrcp->timer);
+      putcrs16(OWNERL, pcbp & 0xFFFF);
+      return;
+    }
+  }
+
   regp = pcbp+PCBREGS;
   mask = get16r0(pcbp+PCBMASK);
   for (i=0; i<020; i++) {
@@ -3224,6 +4534,19 @@ static void pxregload (ea_t pcbp) {
   putcrs32(TIMER, get32r0(pcbp+PCBIT));
   putcrs16(OWNERL, pcbp & 0xFFFF);
 
+  /* the save area was only read, so it can be cached */
+
+  if (pxrcp != NULL) {
+    for (i=0; i<020; i++)
+      pxrcp->gr[i] = getgr32(i);
+    pxrcp->keys = get16r0(pcbp+PCBKEYS);
+    pxrcp->dtar2 = getcrs32(DTAR2);
+    pxrcp->dtar3 = getcrs32(DTAR3);
+    pxrcp->timer = getcrs32(TIMER);
+    pxrcp->pa = pa;
+    cachepage[pa >> 10] |= CP_PXR;
+  }
+
   TRACE(T_PX, "pxregload: registers loaded, ownerl=%o, modals=%o\n", getcrs16(OWNERL), getcrs16(MODALS));
 }
 
@@ -3239,6 +4562,7 @@ static void ors(unsigned short pcbw) {
   unsigned short modals;
 
 
+  ccflush();             /* pending CCs belong to the current reg set */
   currs = (getcrs16(MODALS) & 0340) >> 5;
   TRACE(T_PX, "ors: currs = %d, modals = %o\n", currs, getcrs16(MODALS));
 
@@ -3252,8 +4576,8 @@ static void ors(unsigned short pcbw) {
   ownedx = freex = savedx = -1;
   for (rx = regsets[cpuid]-1; rx >= 0; rx--) {   /* search LRU first */
     rs = regq[rx];
-    TRACE(T_PX, "ors: check rs %d: owner=%o/%o, saved=%d\n", rs, swap32(regs.sym.userregs[rs][21])>>16, swap32(regs.sym.userregs[rs][21]) & 0xFFFF, swap32(regs.sym.userregs[rs][20]) & 1);
-    ownerl = swap32(regs.sym.userregs[rs][21]) & 0xFFFF;      /* OWNERH/OWNERL */
+    TRACE(T_PX, "ors: check rs %d: owner=%o/%o, saved=%d\n", rs, regs.sym.userregs[rs][21]>>16, regs.sym.userregs[rs][21] & 0xFFFF, regs.sym.userregs[rs][20] & 1);
+    ownerl = regs.sym.userregs[rs][21] & 0xFFFF;      /* OWNERH/OWNERL */
 
     /* NOTE: could stick breaks after a rs is found, except that for
        debug, I wanted to make sure a process never owns 2 register sets */
@@ -3264,7 +4588,7 @@ static void ors(unsigned short pcbw) {
       ownedx = rx;
     } else if (ownerl == 0)
       freex = rx;
-    else if (savedx < 0 && (swap32(regs.sym.userregs[rs][20]) & 1)) /* KEYS/MODALS */
+    else if (savedx < 0 && (regs.sym.userregs[rs][20] & 1)) /* KEYS/MODALS */
       savedx = rx;
   }
   if (ownedx >= 0) {
@@ -3456,7 +4780,7 @@ static void dispatcher() {
     TRACE(T_PX, "disp: reg set already owned by %o: no save or load\n", getcrs16(OWNERL));
     /* NOTE: call newkeys to make sure amask gets set correctly!
        Otherwise, 32R mode programs are flaky */
-    newkeys(getcrs16(KEYS));
+    newkeys(getkeys());
   } else {
     pxregsave(0);
     pxregload(pcbp);
@@ -3471,7 +4795,7 @@ static void dispatcher() {
   if (RPL < gv.livereglim && ((getcrs16(KEYS) & 0016000) != 010000))
     RP |= 0x80000000;
   putcrs16(PBL, 0);
-  putcrs16(KEYS, getcrs16(KEYS) & ~3);      /* erase "in dispatcher" and "save done" */
+  putkeys(getkeys() & ~3);      /* erase "in dispatcher" and "save done" */
   TRACE(T_PX, "disp: returning from dispatcher, running process %o/%o at %o/%o, modals=%o, ppa=%o, pla=%o, ppb=%o, plb=%o\n", getcrs16(OWNERH), getcrs16(OWNERL), RPH, RPL, getcrs16(MODALS), getar16(PCBA16), getar16(PLA16), getar16(PCBB16), getar16(PLB16));
 
   /* if this process' abort flags are set, clear them and take process fault */
@@ -3617,7 +4941,7 @@ static void pwait() {
   short count;
 
   ea = apea(NULL);
-  TRACE(T_PX, "%o/%o: wait on %o/%o, pcb %o, keys=%o, modals=%o\n", RPH, RPL, ea>>16, ea&0xFFFF, getcrs16(OWNERL), getcrs16(KEYS), getcrs16(MODALS));
+  TRACE(T_PX, "%o/%o: wait on %o/%o, pcb %o, keys=%o, modals=%o\n", RPH, RPL, ea>>16, ea&0xFFFF, getcrs16(OWNERL), getkeys(), getcrs16(MODALS));
   utempl = get32r0(ea);       /* get count and BOL */
   count = utempl>>16;         /* count (signed) */
   bol = utempl & 0xFFFF;      /* beginning of wait list */
@@ -3753,8 +5077,8 @@ static void lpsw() {
   unsigned short m;
 
   TRACE(T_PX, "\n%o/%o: LPSW issued\n", RPH, RPL);
-  TRACE(T_PX, "LPSW: before load, RPH=%o, RPL=%o, keys=%o, modals=%o, owner=%o/%o\n", RPH, RPL, getcrs16(KEYS), getcrs16(MODALS), getcrs16(OWNERH), getcrs16(OWNERL));
-  TRACE(T_PX, "LPSW: crs=%d, ownerl[2]=%o, keys[2]=%o, modals[2]=%o, ownerl[3]=%o, keys[3]=%o, modals[3]=%o\n", crs==regs.rs16[2]? 2:3, swap16(regs.rs16[2][OWNERL]), swap16(regs.rs16[2][KEYS]), swap16(regs.rs16[2][MODALS]), swap16(regs.rs16[3][OWNERL]), swap16(regs.rs16[3][KEYS]), swap16(regs.rs16[3][MODALS]));
+  TRACE(T_PX, "LPSW: before load, RPH=%o, RPL=%o, keys=%o, modals=%o, owner=%o/%o\n", RPH, RPL, getkeys(), getcrs16(MODALS), getcrs16(OWNERH), getcrs16(OWNERL));
+  TRACE(T_PX, "LPSW: crs=%d, ownerl[2]=%o, keys[2]=%o, modals[2]=%o, ownerl[3]=%o, keys[3]=%o, modals[3]=%o\n", crs==regs.rs16[2]? 2:3, regs.rs16[2][RF16(OWNERL)], regs.rs16[2][RF16(KEYS)], regs.rs16[2][RF16(MODALS)], regs.rs16[3][RF16(OWNERL)], regs.rs16[3][RF16(KEYS)], regs.rs16[3][RF16(MODALS)]);
 
   ea = apea(NULL);
   RPH = get16(ea);
@@ -3787,8 +5111,8 @@ static void lpsw() {
   putcrs16(MODALS, m);
   gv.inhcount = 1;
 
-  TRACE(T_PX, "LPSW:    NEW RPH=%o, RPL=%o, keys=%o, modals=%o, owner=%o/%o\n", RPH, RPL, getcrs16(KEYS), getcrs16(MODALS), getcrs16(OWNERH), getcrs16(OWNERL));
-  TRACE(T_PX, "LPSW: crs=%d, ownerl[2]=%o, keys[2]=%o, modals[2]=%o, ownerl[3]=%o, keys[3]=%o, modals[3]=%o\n", crs==regs.rs16[2]? 2:3, swap16(regs.rs16[2][OWNERL]), swap16(regs.rs16[2][KEYS]), swap16(regs.rs16[2][MODALS]), swap16(regs.rs16[3][OWNERL]), swap16(regs.rs16[3][KEYS]), swap16(regs.rs16[3][MODALS]));
+  TRACE(T_PX, "LPSW:    NEW RPH=%o, RPL=%o, keys=%o, modals=%o, owner=%o/%o\n", RPH, RPL, getkeys(), getcrs16(MODALS), getcrs16(OWNERH), getcrs16(OWNERL));
+  TRACE(T_PX, "LPSW: crs=%d, ownerl[2]=%o, keys[2]=%o, modals[2]=%o, ownerl[3]=%o, keys[3]=%o, modals[3]=%o\n", crs==regs.rs16[2]? 2:3, regs.rs16[2][RF16(OWNERL)], regs.rs16[2][RF16(KEYS)], regs.rs16[2][RF16(MODALS)], regs.rs16[3][RF16(OWNERL)], regs.rs16[3][RF16(KEYS)], regs.rs16[3][RF16(MODALS)]);
   if (getcrs16(MODALS) & 020)
     TRACE(T_PX, "Mapped I/O enabled\n");
   if (getcrs16(MODALS) & 4) {
@@ -3811,10 +5135,10 @@ static void lpsw() {
     }
 #endif
     if (getcrs16(KEYS) & 2) {
-      TRACE(T_PX, "LPSW: before disp, RPH=%o, RPL=%o, keys=%o, modals=%o\n", RPH, RPL, getcrs16(KEYS), getcrs16(MODALS));
+      TRACE(T_PX, "LPSW: before disp, RPH=%o, RPL=%o, keys=%o, modals=%o\n", RPH, RPL, getkeys(), getcrs16(MODALS));
       dispatcher();
-      TRACE(T_PX, "LPSW: after disp, RPH=%o, RPL=%o, keys=%o, modals=%o\n", RPH, RPL, getcrs16(KEYS), getcrs16(MODALS));
-      TRACE(T_PX, "LPSW: crs=%d, ownerl[2]=%o, keys[2]=%o, modals[2]=%o, ownerl[3]=%o, keys[3]=%o, modals[3]=%o\n", crs==regs.rs16[2]? 2:3, swap16(regs.rs16[2][OWNERL]), swap16(regs.rs16[2][KEYS]), swap16(regs.rs16[2][MODALS]), swap16(regs.rs16[3][OWNERL]), swap16(regs.rs16[3][KEYS]), swap16(regs.rs16[3][MODALS]));
+      TRACE(T_PX, "LPSW: after disp, RPH=%o, RPL=%o, keys=%o, modals=%o\n", RPH, RPL, getkeys(), getcrs16(MODALS));
+      TRACE(T_PX, "LPSW: crs=%d, ownerl[2]=%o, keys[2]=%o, modals[2]=%o, ownerl[3]=%o, keys[3]=%o, modals[3]=%o\n", crs==regs.rs16[2]? 2:3, regs.rs16[2][RF16(OWNERL)], regs.rs16[2][RF16(KEYS)], regs.rs16[2][RF16(MODALS)], regs.rs16[3][RF16(OWNERL)], regs.rs16[3][RF16(KEYS)], regs.rs16[3][RF16(MODALS)]);
     }
   }
 }
@@ -4134,13 +5458,13 @@ static inline unsigned int tcr(unsigned int un) {
 
   utempl = -(int)un;
   if (utempl != 0) {    /* clear C, L, EQ, set LT from bit 1 */
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0120300) | ((utempl & 0x80000000) >> 24));
+    putkeys((getkeys() & ~0120300) | ((utempl & 0x80000000) >> 24));
     if (utempl == 0x80000000) {
       CLEARLT;
       mathexception('i', FC_INT_OFLOW, 0);
     }
   } else
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0120300) | 020100);  /* set L, EQ */
+    putkeys((getkeys() & ~0120300) | 020100);  /* set L, EQ */
   return utempl;
 }
 
@@ -4150,13 +5474,13 @@ static inline unsigned short tch (unsigned short un) {
 
   utemp = -(short)un;
   if (utemp != 0) {    /* clear C, L, EQ, set LT from bit 1 */
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0120300) | ((utemp & 0x8000) >> 8));
+    putkeys((getkeys() & ~0120300) | ((utemp & 0x8000) >> 8));
     if (utemp == 0x8000) {
       CLEARLT;
       mathexception('i', FC_INT_OFLOW, 0);
     }
   } else
-    putcrs16(KEYS, (getcrs16(KEYS) & ~0120300) | 020100);  /* set L, EQ */
+    putkeys((getkeys() & ~0120300) | 020100);  /* set L, EQ */
   return utemp;
 }
 
@@ -4169,27 +5493,25 @@ static int add32(unsigned int a1, unsigned int a2, unsigned int a3, ea_t ea) {
   unsigned long long utemp;
   short link, eq, lt;
 
-  putcrs16(KEYS, getcrs16(KEYS) & ~0120300);
-  link = eq = lt = 0;
   utemp = a1;                              /* expand to higher precision */
   utemp += a2;                             /* double-precision add */
   utemp += a3;                             /* again, for subtract */
   uresult = utemp;                         /* truncate result to result size */
   retval = uresult;
+  if (((~a1 ^ a2) & (a1 ^ uresult) & 0x80000000) == 0) {
+    gv.ccval = utemp;                      /* no overflow: lazy CCs */
+    gv.cckind = CC_ADD32;
+    return retval;
+  }
+  link = eq = lt = 0;
   if (utemp & 0x100000000LL)               /* set L-bit if carry occurred */
     link = 020000;  
   if (uresult == 0)                        /* set EQ? */
     eq = 0100; 
-  if (((~a1 ^ a2) & (a1 ^ uresult) & 0x80000000) == 0) {
-    if (*(int *)&uresult < 0)
-      lt = 0200;
-    putcrs16(KEYS, getcrs16(KEYS) | link | eq | lt);
-  } else {
-    if (*(int *)&uresult >= 0)
-      lt = 0200;
-    putcrs16(KEYS, getcrs16(KEYS) | link | eq | lt);
-    mathexception('i', FC_INT_OFLOW, 0);
-  }
+  if (*(int *)&uresult >= 0)
+    lt = 0200;
+  putkeys((getkeys() & ~0120300) | link | eq | lt);
+  mathexception('i', FC_INT_OFLOW, 0);
   return retval;
 }
 
@@ -4197,33 +5519,35 @@ static int add16(unsigned short a1, unsigned short a2, unsigned short a3, ea_t e
 
   unsigned short retval;
   unsigned int uresult;
-  int keybits, oflow;
+  int keybits;
 
   uresult = a1;                            /* expand to higher precision */
   uresult += a2;                           /* double-precision add */
   uresult += a3;                           /* again, for subtract */
+  retval = uresult;                        /* save truncated result */
+  if (((~a1 ^ a2) & (a1 ^ uresult) & 0x8000) == 0) {
+    gv.ccval = uresult;                    /* no overflow: lazy CCs */
+    gv.cckind = CC_ADD16;
+    return retval;
+  }
   keybits = (uresult & 0x10000) >> 3;      /* set L-bit if carry occurred */  
   uresult &= 0xFFFF;                       /* truncate result */
-  retval = uresult;                        /* save result */
   if (uresult == 0)                        /* set EQ? */
     keybits |= 0100; 
-  oflow = (((~a1 ^ a2) & (a1 ^ uresult) & 0x8000) != 0); /* overflow! */
-  if (oflow)
-    uresult = ~uresult;
+  uresult = ~uresult;                      /* overflow: LT is inverted */
   keybits |= (uresult & 0x8000) >> 8;      /* set LT if result negative */
-  putcrs16(KEYS, getcrs16(KEYS) & ~0120300 | keybits);
-  if (oflow)
-    mathexception('i', FC_INT_OFLOW, ea);
+  putkeys(getkeys() & ~0120300 | keybits);
+  mathexception('i', FC_INT_OFLOW, ea);
   return retval;
 }
 
 
 static void inline adlr(int dr) {
 
-  if (getcrs16(KEYS) & 020000)
+  if (getkeys() & 020000)
     putgr32(dr, add32(getgr32(dr), 1, 0, 0));
   else {
-    putcrs16(KEYS, getcrs16(KEYS) & ~0120300);    /* clear C, L, LT, EQ */
+    putkeys(getkeys() & ~0120300);    /* clear C, L, LT, EQ */
     SETCC_32(getgr32(dr));
   }
 }
@@ -4263,6 +5587,8 @@ static void inline pimh(int dr) {
 static int ldar(ea_t ea) {
   unsigned int result;
 
+  ccflush();                 /* keys may be read as a register */
+
   if (ea & 040000) {       /* absolute RF addressing */
     RESTRICT();
 
@@ -4290,6 +5616,8 @@ static int ldar(ea_t ea) {
 
 static void star(unsigned int val32, ea_t ea) {
 
+  ccflush();                 /* keys may be stored as a register */
+
   if (ea & 040000) {       /* absolute RF addressing */
     RESTRICT();
     if ((ea & 0777) > 0477) {
@@ -4308,6 +5636,65 @@ static void star(unsigned int val32, ea_t ea) {
 }
 
 
+/* bulk helpers for the character instructions.  The Z instructions
+   work a page span at a time: ZSTEP maps a page and gives the number
+   of bytes left in it, and these process a span.
+
+   zmvspan copies forward, one byte at a time as the hardware does.
+   If the destination overlaps the source from above, the overlapping
+   bytes repeat; Primos depends on this to propagate a character.
+   memmove is only used when it gives the same result. */
+
+static void zmvspan(unsigned char *d, unsigned char *s, int n) {
+  int k;
+
+  if (d <= s || d >= s+n)
+    memmove(d, s, n);
+  else if (d == s+1)
+    memset(d, *s, n);
+  else
+    while (n > 0) {
+      k = d - s;
+      if (k > n)
+	k = n;
+      memcpy(d, s, k);
+      d += k;
+      s += k;
+      n -= k;
+    }
+}
+
+/* translates a span through a 256-byte table, in order, so an
+   overlapping source and destination behave as on the hardware */
+
+static void ztrnspan(unsigned char *d, unsigned char *s, int n, unsigned char *tab) {
+
+  while (n-- > 0)
+    *d++ = tab[*s++];
+}
+
+/* compares a span to a fill character, like memcmp; used for the
+   blank-filled tail of the shorter ZCM string.  8 bytes are checked
+   at a time until there is a difference */
+
+static int zcmpfill(unsigned char *p, int n, unsigned char fill) {
+  unsigned long long f8, w;
+
+  f8 = fill * 0x0101010101010101ULL;
+  while (n >= 8) {
+    memcpy(&w, p, 8);
+    if (w != f8)
+      break;
+    p += 8;
+    n -= 8;
+  }
+  for (; n > 0; p++, n--)
+    if (*p != fill)
+      return (*p < fill) ? -1 : 1;
+  return 0;
+}
+
+
 /* here for PIO instructions: OCP, SKS, INA, OTA.  The instruction
    word is passed in as an argument to handle EIO (Execute I/O) in
    V/I modes. */
@@ -4357,6 +5744,9 @@ int main (int argc, char **argv) {
   int nw,nw2;
   unsigned short rvec[9];    /* SA, EA, P, A, B, X, keys, dummy, dummy */
   unsigned short inst;
+  pdce_t *pdcp;                        /* predecoded instruction, or NULL */
+  pa_t pdcpagea;
+  int pdcslot;
   unsigned short m;
   short scount;                          /* shift count */
   unsigned short trapvalue;
@@ -4364,12 +5754,21 @@ int main (int argc, char **argv) {
   unsigned short access;
   unsigned int immu32;
   unsigned long long immu64;
-  unsigned short zresult, zclen1, zclen2, zaccess;
+  unsigned short zresult, zclen1, zclen2, zspan;
   unsigned int zlen1, zlen2;
+  unsigned short *zedp;
+  int zedn;
+  unsigned char ztrtab[256];
   ea_t zea1, zea2;
   unsigned char zch1, zch2, *zcp1, *zcp2, zspace;
   unsigned char xsc, xfc, xsign, xsig;
 
+  /* EA calculation and dispatch for each CPU mode (keys bits 4-6).
+     The undefined modes 5 and 7 act as 32S and 32R, as they did when
+     the mode was decoded bit by bit */
+
+  static void *disp_mode[8] = {&&m_16s, &&m_32s, &&m_64r, &&m_32r, &&imode, &&m_32s, &&m_64v, &&m_32r};
+
   /* Prime ASCII constants for decimal instructions */
 
 #define XPLUS 0253
@@ -4447,6 +5846,10 @@ int main (int argc, char **argv) {
   signal (SIGTERM, sensorcheck);
   signal (SIGQUIT, sigquit);
 
+  /* on SIGUSR1, save the machine in the -snapshot file */
+
+  signal (SIGUSR1, snapsignal);
+
 #ifndef NOTRACE
 
   /* open trace log */
@@ -4546,9 +5949,29 @@ int main (int argc, char **argv) {
 	  gv.memlimit = templ*1024/2*1024;
 	else
 	  fatal("-mem arg range is 1 to 512 (megabytes)\n");
+	if (i+1 < argc && strcmp(argv[i+1],"huge") == 0) {
+	  i++;
+	  memhuge = 1;
+	}
       } else
 	fatal("-mem needs an argument\n");
 
+    } else if (strcmp(argv[i],"-stlb") == 0) {
+      if (i+1 < argc && argv[i+1][0] != '-') {
+	sscanf(argv[++i],"%d", &templ);
+	if (templ < 512 || templ > STLBMAXSETS || (templ & (templ-1)))
+	  fatal("-stlb sets must be a power of 2 from 512 to 2048\n");
+	stlbsets = templ;
+	stlbways = 1;
+	if (i+1 < argc && argv[i+1][0] != '-') {
+	  sscanf(argv[++i],"%d", &templ);
+	  if (templ != 1 && templ != 2 && templ != STLBMAXWAYS)
+	    fatal("-stlb ways must be 1, 2, or 4\n");
+	  stlbways = templ;
+	}
+      } else
+	fatal("-stlb needs an argument\n");
+
     } else if (strcmp(argv[i],"-nport") == 0) {
       if (i+1 < argc && argv[i+1][0] != '-') {
 	sscanf(argv[++i],"%d", &templ);
@@ -4569,6 +5992,67 @@ int main (int argc, char **argv) {
       } else
 	fatal("-tport needs an argument\n");
 
+    } else if (strcmp(argv[i],"-diskmap") == 0) {
+      diskmap = 1;
+      while (i+1 < argc && argv[i+1][0] != '-') {
+	i++;
+	if (strcmp(argv[i],"seq") == 0)
+	  diskmapadvice = MADV_SEQUENTIAL;
+	else if (strcmp(argv[i],"random") == 0)
+	  diskmapadvice = MADV_RANDOM;
+	else if (strcmp(argv[i],"sync") == 0)
+	  diskmapsync = 1;
+	else
+	  fatal("-diskmap options are seq, random, and sync\n");
+      }
+
+    } else if (strcmp(argv[i],"-snapshot") == 0) {
+      if (i+1 < argc && argv[i+1][0] != '-')
+	snapfile = argv[++i];
+      else
+	fatal("-snapshot needs an argument\n");
+
+    } else if (strcmp(argv[i],"-checkpoint") == 0) {
+#ifndef DISKSAFE
+      fatal("-checkpoint needs a DISKSAFE build, so the drives can be checkpointed\n");
+#endif
+      if (i+1 < argc && argv[i+1][0] != '-') {
+	ckptfile = argv[++i];
+	if (i+1 < argc && argv[i+1][0] != '-') {
+	  sscanf(argv[++i],"%d", &templ);
+	  if (templ < 1)
+	    fatal("-checkpoint interval must be at least 1 minute\n");
+	  ckptmins = templ;
+	}
+      } else
+	fatal("-checkpoint needs an argument\n");
+
+    } else if (strcmp(argv[i],"-restore") == 0) {
+      if (i+1 < argc && argv[i+1][0] != '-')
+	restorefile = argv[++i];
+      else
+	fatal("-restore needs an argument\n");
+
+#ifdef DISKSAFE
+    } else if (strcmp(argv[i],"-disksafe") == 0) {
+      if (i+1 < argc && argv[i+1][0] != '-') {
+	i++;
+	if (strcmp(argv[i],"commit") == 0)
+	  disksafeop = DS_COMMIT;
+	else if (strcmp(argv[i],"discard") == 0)
+	  disksafeop = DS_DISCARD;
+	else
+	  fatal("-disksafe options are commit and discard\n");
+      } else
+	fatal("-disksafe needs an argument\n");
+
+    } else if (strcmp(argv[i],"-diskbase") == 0) {
+      if (i+1 < argc && argv[i+1][0] != '-')
+	diskbase = argv[++i];
+      else
+	fatal("-diskbase needs an argument\n");
+#endif
+
 #ifndef NOTRACE
     } else if (strcmp(argv[i],"-trace") == 0) {
       while (i+1 < argc && argv[i+1][0] != '-') {
@@ -4697,8 +6181,37 @@ int main (int argc, char **argv) {
     gv.stlb[i].seg = 0xFFFF;        /* marker for invalid STLB entry */
   for (i=0; i < IOTLBENTS; i++)
     gv.iotlb[i].valid = 0;
-  physmem = malloc(gv.memlimit * sizeof(*physmem));
-  bzero(MEM, 64*1024*2);              /* zero first 64K words */
+  physmem = mmap(NULL, gv.memlimit * sizeof(*physmem), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (physmem == MAP_FAILED) {
+    physmem = NULL;
+    perror("Unable to allocate physical memory");
+    fatal(NULL);
+  }
+#ifdef MADV_HUGEPAGE
+  if (memhuge && madvise(physmem, gv.memlimit * sizeof(*physmem), MADV_HUGEPAGE) == -1)
+    perror("em: unable to use huge pages for memory");
+#else
+  if (memhuge)
+    fprintf(stderr, "em: huge pages aren't supported on this host\n");
+#endif
+  pdc = calloc(PDCPAGES, sizeof(*pdc));
+  if (pdc == NULL)
+    fatal("Unable to allocate predecode cache");
+  pdcinvall();
+  pxrcinvall();
+  memdirty = calloc(gv.memlimit/1024, 1);
+  if (memdirty == NULL)
+    fatal("Unable to allocate memory dirty map");
+  cachepage = calloc(gv.memlimit/1024, 1);
+  if (cachepage == NULL)
+    fatal("Unable to allocate cache page map");
+  stlbrmap = calloc(gv.memlimit/1024, sizeof(*stlbrmap));
+  if (stlbrmap == NULL)
+    fatal("Unable to allocate STLB reverse map");
+  htlbpage = calloc(gv.memlimit/1024, sizeof(*htlbpage));
+  if (htlbpage == NULL)
+    fatal("Unable to allocate htlb page map");
+  sdwcinvall();
   
   /* if no maps were specified on the command line, look for ring0.map and 
      ring3.map in the current directory and read them */
@@ -4748,6 +6261,10 @@ int main (int argc, char **argv) {
   }
   if ((26 <= cpuid && cpuid <= 29) || cpuid >= 35)
     gv.csoffset = 1;
+  if (stlbsets)
+    stlbsize(stlbsets, stlbways);
+  else
+    stlbpreset(cpuid);
 
   /* initialize all devices */
 
@@ -4766,7 +6283,27 @@ int main (int argc, char **argv) {
      SECURITY: check that boot filename isn't a pathname?
   */
 
-  setjmp(bootjmp);
+  /* -restore loads a snapshot instead of booting; a later ctrl-b
+     reboot longjmps here and boots normally.  Committing the overlays
+     would change the drives under the snapshot */
+
+#ifdef DISKSAFE
+  if (restorefile && disksafeop == DS_COMMIT)
+    fatal("-disksafe commit can't be used with -restore");
+#endif
+
+  if (setjmp(bootjmp) == 0 && restorefile) {
+    snaprestore(restorefile);
+    printf("Restored from snapshot %s\n", restorefile);
+
+    /* the STLB geometry is in the snapshot; -stlb overrides it */
+
+    if (stlbsets) {
+      stlbsize(stlbsets, stlbways);
+      stlbrmapbuild();
+    }
+    goto restored;
+  }
 
   if (bootarg) {
     if ((bootfd=open(bootarg, O_RDONLY)) == -1) {
@@ -4878,6 +6415,7 @@ a filename, CPU registers and keys are loaded from the runfile header.\n\
     perror("Error reading memory image");
     fatal(NULL);
   }
+  pdcinvrange(rvec[0], nw);
   if (lseek(bootfd, bootskip, SEEK_CUR) == -1) {
     perror("Error skipping on boot device");
     fatal(NULL);
@@ -4913,6 +6451,27 @@ a filename, CPU registers and keys are loaded from the runfile header.\n\
   }
   RPL = rvec[2];
 
+restored:
+
+  /* start the -checkpoint timer.  If <file> is a link to <file>.0,
+     write <file>.1 first so the newest checkpoint isn't overwritten */
+
+  if (ckptfile) {
+    char linkbuf[MAXPATHLEN];
+    struct itimerval itv;
+
+    if ((templ = readlink(ckptfile, linkbuf, sizeof(linkbuf))) >= 2 && strncmp(linkbuf+templ-2, ".0", 2) == 0)
+      ckptslot = 1;
+    signal (SIGALRM, ckptsignal);
+    itv.it_interval.tv_sec = ckptmins*60;
+    itv.it_interval.tv_usec = 0;
+    itv.it_value = itv.it_interval;
+    if (setitimer(ITIMER_REAL, &itv, NULL) == -1) {
+      perror("Unable to start checkpoint timer");
+      fatal(NULL);
+    }
+  }
+
   /* initialize the timer stuff */
 
   if (gettimeofday(&boot_tv, &tz) != 0) {
@@ -5045,12 +6604,22 @@ fetch:
 
 #define TIMERMASK 0777   /* must be power of 2 - 1 */
 
+  if ((int)(gv.instcount - gv.nextpoll) >= 0)
+    devpolls();
+
   if ((gv.instcount & TIMERMASK) == 0) {
-    for (i=0; i<64; i++)
-      if (devpoll[i] && ((devpoll[i] -= (TIMERMASK+1)) <= 0)) {
-	devpoll[i] = 0;
-	devmap[i](4, 0, i);
-      }
+
+    /* SIGUSR1 and the -checkpoint timer ask for a snapshot at the
+       next instruction boundary; one being made is checked now and
+       then to put it in place */
+
+    if (snapwanted || ckptwanted || ((snappid || snapwritten) && (gv.instcount & 0xFFFFF) == 0))
+      snapcheck();
+
+    /* polls requested by devpollasync */
+
+    if (devkicked)
+      devpolls();
 
     /* bump the 1ms process timer; docs say to only bump this if px is
        enabled, but since it is nearly all the time in practice, it
@@ -5082,7 +6651,7 @@ fetch:
       //printf("fetch: taking interrupt vector '%o, modals='%o\n", gv.intvec, getcrs16(MODALS));
       TRACE(T_FLOW, "\nfetch: taking interrupt vector '%o, modals='%o\n", gv.intvec, getcrs16(MODALS));
       putar32(PSWPB32, RP & 0x7FFFFFFF);
-      regs.sym.pswkeys = crs[KEYS];              /* Prime->Prime: no byte swap */
+      putar16(PSWKEYS16, getkeys());
 
       /* NOTE: this code doesn't match the description on page B-21 of
 	 the Sys Arch Guide 2nd Ed. for Standard Interrupt Mode */
@@ -5158,7 +6727,42 @@ fetch:
 
   inst = iget16(RP | ((RPL >= gv.livereglim || (getcrs16(KEYS) & 0016000) == 010000) ? 0 : 0x80000000));
 #else
+
+#ifdef FAST
+
+  /* in 64V mode, if RP is in the RPBR page, use the predecode cache */
+
+  if ((getcrs16(KEYS) & 016000) == 014000 && (RP & 0x8FFFFC00) == (gv.brp[RPBR].vpn & 0x0FFFFFFF)) {
+    pdcpagea = gv.brp[RPBR].memp - MEM;
+    pdcslot = (pdcpagea >> 10) & (PDCPAGES-1);
+    if (pdctag[pdcslot] != pdcpagea)
+      pdcload(pdcslot, pdcpagea);
+    pdcp = &pdc[pdcslot][RP & 0x3FF];
+    if (pdcp->gen != pdcgen[pdcslot]) {
+      inst = swap16(gv.brp[RPBR].memp[RP & 0x3FF]);
+      pdcp->inst = inst;
+      if ((inst & 036000) == 0) {
+	pdcp->form = PDC_GEN;
+	pdcp->disp = disp_gen[GENIX(inst)];
+      } else {
+	pdcp->disp = gv.disp_vmr[VMRINSTIX(inst)];
+	if ((inst & 01740) == 01400 && (RP & 0x3FF) != 0x3FF) {
+	  pdcp->form = PDC_VLONG;
+	  pdcp->a = swap16(gv.brp[RPBR].memp[(RP & 0x3FF) + 1]);
+	} else
+	  pdcp->form = PDC_VSHORT;
+      }
+      pdcp->gen = pdcgen[pdcslot];
+    }
+    inst = pdcp->inst;
+  } else {
+    pdcp = NULL;
+    inst = iget16(RP);
+  }
+#else
   inst = iget16(RP);
+#endif
+
 #endif
 
   INCRP;
@@ -5193,12 +6797,28 @@ xec:
 #endif
 
 #if 1
-  TRACE(T_FLOW, "\n			#%u [%s %o] IT=%d SB: %o/%o LB: %o/%o %s XB: %o/%o\n%o/%o: %o		A='%o/%u B='%o/%d L='%o/%d E='%o/%d X='%o/%d Y='%o/%d%s%s%s%s K=%o M=%o\n", gv.instcount, searchloadmap(getcrs32(OWNER),'x'), getcrs16(OWNERL), getcrs16s(TIMERH), getcrs16(SBH), getcrs16(SBL), getcrs16(LBH), getcrs16(LBL), searchloadmap(getcrs32(LBH),'l'), getcrs16(XBH), getcrs16(XBL), RPH, RPL-1, inst, getcrs16(A), getcrs16s(A), getcrs16(B), getcrs16s(B), getcrs32(L), getcrs32s(L), getcrs32(E), getcrs32s(E), getcrs16(X), getcrs16s(X), getcrs16(Y), getcrs16s(Y), (getcrs16(KEYS)&0100000)?" C":"", (getcrs16(KEYS)&020000)?" L":"", (getcrs16(KEYS)&0200)?" LT":"", (getcrs16(KEYS)&0100)?" EQ":"", getcrs16(KEYS), getcrs16(MODALS));
+  TRACE(T_FLOW, "\n			#%u [%s %o] IT=%d SB: %o/%o LB: %o/%o %s XB: %o/%o\n%o/%o: %o		A='%o/%u B='%o/%d L='%o/%d E='%o/%d X='%o/%d Y='%o/%d%s%s%s%s K=%o M=%o\n", gv.instcount, searchloadmap(getcrs32(OWNER),'x'), getcrs16(OWNERL), getcrs16s(TIMERH), getcrs16(SBH), getcrs16(SBL), getcrs16(LBH), getcrs16(LBL), searchloadmap(getcrs32(LBH),'l'), getcrs16(XBH), getcrs16(XBL), RPH, RPL-1, inst, getcrs16(A), getcrs16s(A), getcrs16(B), getcrs16s(B), getcrs32(L), getcrs32s(L), getcrs32(E), getcrs32s(E), getcrs16(X), getcrs16s(X), getcrs16(Y), getcrs16s(Y), (getkeys()&0100000)?" C":"", (getkeys()&020000)?" L":"", (getkeys()&0200)?" LT":"", (getkeys()&0100)?" EQ":"", getkeys(), getcrs16(MODALS));
 #else
-  TRACE(T_FLOW, "\n			[%s %o] SB: %o/%o LB: %o/%o %s XB: %o/%o\n%o/%o: %o		A='%o/%u B='%o/%d L='%o/%d E='%o/%d X='%o/%d Y='%o/%d%s%s%s%s K=%o M=%o\n", searchloadmap(getcrs32(OWNER),'x'), getcrs16(OWNERL), getcrs16(SBH), getcrs16(SBL), getcrs16(LBH), getcrs16(LBL), searchloadmap(getcrs32(LBH),'l'), getcrs16(XBH), getcrs16(XBL), RPH, RPL-1, inst, getcrs16(A), getcrs16s(A), getcrs16(B), getcrs16s(B), getcrs32(L), getcrs32s(L), getcrs32(E), getcrs32s(E), getcrs16(X), getcrs16s(X), getcrs16(Y), getcrs16s(Y), (getcrs16(KEYS)&0100000)?" C":"", (getcrs16(KEYS)&020000)?" L":"", (getcrs16(KEYS)&0200)?" LT":"", (getcrs16(KEYS)&0100)?" EQ":"", getcrs16(KEYS), getcrs16(MODALS) & 0177437);
+  TRACE(T_FLOW, "\n			[%s %o] SB: %o/%o LB: %o/%o %s XB: %o/%o\n%o/%o: %o		A='%o/%u B='%o/%d L='%o/%d E='%o/%d X='%o/%d Y='%o/%d%s%s%s%s K=%o M=%o\n", searchloadmap(getcrs32(OWNER),'x'), getcrs16(OWNERL), getcrs16(SBH), getcrs16(SBL), getcrs16(LBH), getcrs16(LBL), searchloadmap(getcrs32(LBH),'l'), getcrs16(XBH), getcrs16(XBL), RPH, RPL-1, inst, getcrs16(A), getcrs16s(A), getcrs16(B), getcrs16s(B), getcrs32(L), getcrs32s(L), getcrs32(E), getcrs32s(E), getcrs16(X), getcrs16s(X), getcrs16(Y), getcrs16s(Y), (getkeys()&0100000)?" C":"", (getkeys()&020000)?" L":"", (getkeys()&0200)?" LT":"", (getkeys()&0100)?" EQ":"", getkeys(), getcrs16(MODALS) & 0177437);
+#endif
+
+  /* begin instruction decode: predecoded? */
+
+#ifdef FAST
+  if (pdcp != NULL) {
+    if (pdcp->form == PDC_VLONG) {
+      INCRP;
+      ea = ea64vlong(inst, pdcp->a, earp);
+      TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
+    } else if (pdcp->form == PDC_VSHORT) {
+      ea = ea64v(inst, earp);
+      TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
+    }
+    goto *pdcp->disp;
+  }
 #endif
 
-  /* begin instruction decode: generic? */
+  /* generic? */
 
   if ((inst & 036000) == 0)
     goto *disp_gen[GENIX(inst)];
@@ -5231,37 +6851,46 @@ xec:
 
   TRACE(T_EAR|T_EAV, " op=%#05o, i=%o, x=%o, mode=%d\n", ((inst & 036000) != 032000) ? ((inst & 036000) >> 4) : ((inst & 076000) >> 4), inst & 0100000, ((inst & 036000) != 032000) ? (inst & 040000) : 0, (getcrs16(KEYS) & 016000) >> 10);
 
-  if ((getcrs16(KEYS) & 016000) == 014000) {   /* 64V mode */
-    ea = ea64v(inst, earp);
-    TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
-    goto *(gv.disp_vmr[VMRINSTIX(inst)]);
+  goto *disp_mode[(getcrs16(KEYS) & 016000) >> 10];
 
-  } else if ((getcrs16(KEYS) & 0016000) == 010000) {  /* E32I */
-      goto imode;
-    
-  } else if ((inst & 036000) == 030000) { /* check for pio in S/R modes, */
-    pio(inst);                            /* before calculating EA */
-    goto fetch;
+  /* mode-specific EA calculation and dispatch, indexed by the mode
+     bits in keys.  The keys are tested here rather than having
+     newkeys() select a loop, because keys can also change without
+     newkeys: ORS switches register sets, and STLR can store into
+     the keys register. */
 
-  } else if (getcrs16(KEYS) & 004000) {        /* 32R/64R */
-    ea = ea32r64r(earp, inst);
-    TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
-    goto *(gv.disp_rmr[RMRINSTIX(inst)]);
+m_64v:
+  ea = ea64v(inst, earp);
+  TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
+  goto *(gv.disp_vmr[VMRINSTIX(inst)]);
 
-  } else if (getcrs16(KEYS) & 002000) {
-    ea = ea32s(inst);
-    TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
-    goto *(gv.disp_rmr[SMRINSTIX(inst)]);
+m_64r:
+m_32r:
+  if ((inst & 036000) == 030000) {        /* check for pio in S/R modes, */
+    pio(inst);                            /* before calculating EA */
+    goto fetch;
+  }
+  ea = ea32r64r(earp, inst);
+  TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
+  goto *(gv.disp_rmr[RMRINSTIX(inst)]);
 
-  } else if ((getcrs16(KEYS) & 016000) == 0) {
-    ea = ea16s(inst);
-    TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
-    goto *(gv.disp_rmr[SMRINSTIX(inst)]);
+m_32s:
+  if ((inst & 036000) == 030000) {
+    pio(inst);
+    goto fetch;
+  }
+  ea = ea32s(inst);
+  TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
+  goto *(gv.disp_rmr[SMRINSTIX(inst)]);
 
-  } else {
-    printf("Bad CPU mode in EA calculation, keys = %o\n", getcrs16(KEYS));
-    fatal(NULL);
+m_16s:
+  if ((inst & 036000) == 030000) {
+    pio(inst);
+    goto fetch;
   }
+  ea = ea16s(inst);
+  TRACE(T_FLOW, " EA: %o/%o  %s\n",ea>>16, ea & 0xFFFF, searchloadmap(ea,' '));
+  goto *(gv.disp_rmr[SMRINSTIX(inst)]);
 
 
   /* generic instructions */
@@ -5439,7 +7068,7 @@ d_prtn:  /* 000611 */
 
 d_tka:  /* 001005 */
   TRACE(T_FLOW, " TKA\n");
-  putcrs16(A, getcrs16(KEYS));
+  putcrs16(A, getkeys());
   goto fetch;
 
 d_tak:  /* 001015 */
@@ -5556,7 +7185,9 @@ d_calf:  /* 000705 */
   */
 
 #define ZSTEP(zea, zlen, zcp, zclen, zacc) \
-  zcp = (unsigned char *) (MEM+mapva(zea, RP, zacc, &zaccess)); \
+  zcp = (unsigned char *) (MEM+htlbpa(zea, RP, zacc)); \
+  if (zacc == WACC) \
+    pdcinvrange((unsigned short *)zcp - MEM, 1024 - (zea & 01777)); \
   zclen = 2048 - (zea & 01777)*2; \
   if (zea & EXTMASK32) { \
     zcp++; \
@@ -5585,12 +7216,70 @@ d_calf:  /* 000705 */
   zclen--; \
   zlen--
 
+/* span versions of ZPUTC and ZGETC: put n copies of zch, move n
+   chars from 1 to 2 (stops early if string 1 ends), skip n chars */
+
+#define ZPUTS(zea, zlen, zcp, zclen, zch, n) \
+  while (n) { \
+    if (zclen == 0) { \
+      ZSTEP(zea, zlen, zcp, zclen, WACC); \
+    } \
+    zspan = (n < zclen) ? n : zclen; \
+    memset(zcp, zch, zspan); \
+    zcp += zspan; \
+    zclen -= zspan; \
+    zlen -= zspan; \
+    n -= zspan; \
+  }
+
+#define ZMOVS(n) \
+  while (n && zlen1) { \
+    if (zclen1 == 0) { \
+      ZSTEP(zea1, zlen1, zcp1, zclen1, RACC); \
+    } \
+    if (zclen2 == 0) { \
+      ZSTEP(zea2, zlen2, zcp2, zclen2, WACC); \
+    } \
+    zspan = (zclen1 < zclen2) ? zclen1 : zclen2; \
+    if (n < zspan) \
+      zspan = n; \
+    zmvspan(zcp2, zcp1, zspan); \
+    zcp1 += zspan; \
+    zcp2 += zspan; \
+    zclen1 -= zspan; \
+    zclen2 -= zspan; \
+    zlen1 -= zspan; \
+    zlen2 -= zspan; \
+    n -= zspan; \
+  }
+
+#define ZSKIPS(zea, zlen, zcp, zclen, n) \
+  while (n) { \
+    if (zclen == 0) { \
+      ZSTEP(zea, zlen, zcp, zclen, RACC); \
+    } \
+    zspan = (n < zclen) ? n : zclen; \
+    zcp += zspan; \
+    zclen -= zspan; \
+    zlen -= zspan; \
+    n -= zspan; \
+  }
+
+/* ZED and XED read their edit program through a host pointer to
+   its first page; only words past that page use get16 */
+
+#define ZEDMAP(ea) \
+  zedp = MEM + htlbpa(ea, RP, RACC); \
+  zedn = 1024 - (ea & 01777)
+
+#define ZEDWORD(ea, i) (((i) < zedn) ? swap16(zedp[i]) : get16(INCVA(ea, i)))
+
 d_zmv:  /* 001114 */
   TRACE(T_FLOW, " ZMV\n");
   zspace = 0240;
   if (getcrs16(KEYS) & 020)
     zspace = 040;
-  TRACE(T_FLOW, "ZMV: source=%o/%o, len=%d, dest=%o/%o, len=%d, keys=%o\n", getgr32(FAR0)>>16, getgr32(FAR0)&0xffff, GETFLR(0), getgr32(FAR1)>>16, getgr32(FAR1)&0xffff, GETFLR(1), getcrs16(KEYS));
+  TRACE(T_FLOW, "ZMV: source=%o/%o, len=%d, dest=%o/%o, len=%d, keys=%o\n", getgr32(FAR0)>>16, getgr32(FAR0)&0xffff, GETFLR(0), getgr32(FAR1)>>16, getgr32(FAR1)&0xffff, GETFLR(1), getkeys());
 
   zlen1 = GETFLR(0);
   zlen2 = GETFLR(1);
@@ -5604,12 +7293,26 @@ d_zmv:  /* 001114 */
   zclen1 = 0;
   zclen2 = 0;
   while (zlen2) {
+    if (zlen1 && zclen1 == 0) {
+      ZSTEP(zea1, zlen1, zcp1, zclen1, RACC);
+    }
+    if (zclen2 == 0) {
+      ZSTEP(zea2, zlen2, zcp2, zclen2, WACC);
+    }
     if (zlen1) {
-      ZGETC(zea1, zlen1, zcp1, zclen1, zch1);
-    } else
-      zch1 = zspace;
-    TRACE(T_FLOW, " zch1=%o (%c)\n", zch1, zch1&0x7f);
-    ZPUTC(zea2, zlen2, zcp2, zclen2, zch1);
+      utempa = (zclen1 < zclen2) ? zclen1 : zclen2;
+      zmvspan(zcp2, zcp1, utempa);
+      zcp1 += utempa;
+      zclen1 -= utempa;
+      zlen1 -= utempa;
+    } else {
+      utempa = zclen2;
+      memset(zcp2, zspace, utempa);
+    }
+    TRACE(T_FLOW, " moved %d\n", utempa);
+    zcp2 += utempa;
+    zclen2 -= utempa;
+    zlen2 -= utempa;
   }
   goto fetch;
 
@@ -5627,50 +7330,29 @@ d_zmvd:  /* 001115 */
   zclen1 = 0;
   zclen2 = 0;
   while (zlen2) {
-#if 0
-    /* this code doesn't run much faster than the 3-line ZGETC/PUTC loop,
-       and sometimes slower.  Suspect there are cache differences. */
-
     if (zclen1 == 0) {
       ZSTEP(zea1, zlen1, zcp1, zclen1, RACC);
     }
     if (zclen2 == 0) {
       ZSTEP(zea2, zlen2, zcp2, zclen2, WACC);
     }
-    if (zclen1 < zclen2)
-      utempa = zclen1;
-    else
-      utempa = zclen2;
+    utempa = (zclen1 < zclen2) ? zclen1 : zclen2;
+    TRACE(T_FLOW, " moved %d\n", utempa);
+    zmvspan(zcp2, zcp1, utempa);
+    zcp1 += utempa;
+    zcp2 += utempa;
     zclen1 -= utempa;
     zclen2 -= utempa;
     zlen1 -= utempa;
     zlen2 -= utempa;
-#if 1
-    /* this works */
-    while (utempa--)
-      *zcp2++ = *zcp1++;
-#else
-    /* this causes error: 
-          Coldstarting PRIMOS, Please wait...
-	  Unable to initialize gate segment.  (GATE_INIT) */
-    memcpy(zcp2, zcp1, utempa);
-#endif
-#else
-    ZGETC(zea1, zlen1, zcp1, zclen1, zch1);
-    TRACE(T_FLOW, " zch1=%o (%c)\n", zch1, zch1&0x7f);
-    ZPUTC(zea2, zlen2, zcp2, zclen2, zch1);
-#endif
   }
   goto fetch;
 
   /* NOTE: ZFIL is used early after PX enabled, and can be used to cause
      a UII fault to debug CALF etc.
 
-     I tried using memset, but it was much slower than a manual loop.
-
-     It may be worthwhile to special case a 2048-byte fill that is
-     page-aligned, since ZFIL is often used this way by Primos, but
-     this isn't a significant overall emulator performance issue. */
+     Each page span is filled with memset; Primos often fills whole,
+     page-aligned 2048-byte pages. */
 
 d_zfil:  /* 001116 */
   TRACE(T_FLOW, " ZFIL\n");
@@ -5682,15 +7364,9 @@ d_zfil:  /* 001116 */
   TRACE(T_FLOW, " ea=%o/%o, len=%d, fill=%o (%c)\n", zea2>>16, zea2&0xffff, zlen2, zch2, zch2&0x7f);
   zclen2 = 0;
   while (zlen2) {
-#if 1
     ZSTEP(zea2, zlen2, zcp2, zclen2, WACC);
     zlen2 -= zclen2;
-    while (zclen2--) {
-      *zcp2++ = zch2;
-    }
-#else
-    ZPUTC(zea2, zlen2, zcp2, zclen2, zch2);
-#endif
+    memset(zcp2, zch2, zclen2);
   }
   goto fetch;
 
@@ -5713,24 +7389,42 @@ d_zcm:  /* 001117 */
   zclen1 = 0;
   zclen2 = 0;
   while (zlen1 || zlen2) {
-    if (zlen1) {
-      ZGETC(zea1, zlen1, zcp1, zclen1, zch1);
-    } else
-      zch1 = zspace;
-    if (zlen2) {
-      ZGETC(zea2, zlen2, zcp2, zclen2, zch2);
-    } else
-      zch2 = zspace;
-    TRACE(T_FLOW, " zch1=%o (%c), zch2=%o (%c)\n", zch1, zch1&0x7f, zch2, zch2&0x7f);
-    if (zch1 < zch2) {
+    if (zlen1 && zclen1 == 0) {
+      ZSTEP(zea1, zlen1, zcp1, zclen1, RACC);
+    }
+    if (zlen2 && zclen2 == 0) {
+      ZSTEP(zea2, zlen2, zcp2, zclen2, RACC);
+    }
+    if (zlen1 && zlen2) {
+      utempa = (zclen1 < zclen2) ? zclen1 : zclen2;
+      templ = memcmp(zcp1, zcp2, utempa);
+    } else if (zlen1) {
+      utempa = zclen1;
+      templ = zcmpfill(zcp1, utempa, zspace);
+    } else {
+      utempa = zclen2;
+      templ = -zcmpfill(zcp2, utempa, zspace);
+    }
+    TRACE(T_FLOW, " compared %d, result %d\n", utempa, templ);
+    if (templ < 0) {
       zresult = 0200;
       break;
-    } else if (zch1 > zch2) {
+    } else if (templ > 0) {
       zresult = 0;
       break;
     }
+    if (zlen1) {
+      zcp1 += utempa;
+      zclen1 -= utempa;
+      zlen1 -= utempa;
+    }
+    if (zlen2) {
+      zcp2 += utempa;
+      zclen2 -= utempa;
+      zlen2 -= utempa;
+    }
   }
-  putcrs16(KEYS, (getcrs16(KEYS) & ~0300) | zresult);
+  putkeys((getkeys() & ~0300) | zresult);
   goto fetch;
 
 d_ztrn:  /* 001110 */
@@ -5748,15 +7442,37 @@ d_ztrn:  /* 001110 */
   zclen1 = 0;
   zclen2 = 0;
   ea = getcrs32ea(XB);
-  while (zlen2) {
-    ZGETC(zea1, zlen1, zcp1, zclen1, zch1);
-    utempa = get16(INCVA(ea,zch1/2));
-    if (zch1 & 1)
-      zch2 = utempa & 0xFF;
+
+  /* the 256-byte translate table is copied once, then each page span
+     is translated.  MEM is in Prime byte order, so if the table is
+     in one page it's a straight copy */
+
+  if (zlen2) {
+    if ((ea & 01777) <= 01777-127)
+      memcpy(ztrtab, MEM + htlbpa(ea, RP, RACC), sizeof(ztrtab));
     else
-      zch2 = utempa >> 8;
-    TRACE(T_FLOW, " zch1=%o (%c), zch2=%o (%c)\n", zch1, zch1&0x7f, zch2, zch2&0x7f);
-    ZPUTC(zea2, zlen2, zcp2, zclen2, zch2);
+      for (i=0; i < 128; i++) {
+	utempa = get16(INCVA(ea,i));
+	ztrtab[2*i] = utempa >> 8;
+	ztrtab[2*i+1] = utempa & 0xFF;
+      }
+  }
+  while (zlen2) {
+    if (zclen1 == 0) {
+      ZSTEP(zea1, zlen1, zcp1, zclen1, RACC);
+    }
+    if (zclen2 == 0) {
+      ZSTEP(zea2, zlen2, zcp2, zclen2, WACC);
+    }
+    zspan = (zclen1 < zclen2) ? zclen1 : zclen2;
+    TRACE(T_FLOW, " translated %d\n", zspan);
+    ztrnspan(zcp2, zcp1, zspan, ztrtab);
+    zcp1 += zspan;
+    zcp2 += zspan;
+    zclen1 -= zspan;
+    zclen2 -= zspan;
+    zlen1 -= zspan;
+    zlen2 -= zspan;
   }
   PUTFLR(1, 0);
   arfa(0, utempl);
@@ -5781,20 +7497,14 @@ d_zed:  /* 001111 */
   zclen1 = 0;
   zclen2 = 0;
   ea = getcrs32ea(XB);
+  ZEDMAP(ea);
   for (i=0; i < 32767; i++) {     /* do edit pgms have a size limit? */
-    utempa = get16(INCVA(ea, i));
+    utempa = ZEDWORD(ea, i);
     m = utempa & 0xFF;
     switch ((utempa >> 8) & 3) {
     case 0:  /* copy M chars */
-      while (m && zlen1) {
-	ZGETC(zea1, zlen1, zcp1, zclen1, zch1);
-	ZPUTC(zea2, zlen2, zcp2, zclen2, zch1);
-	m--;
-      }
-      while (m) {
-	ZPUTC(zea2, zlen2, zcp2, zclen2, zspace);
-	m--;
-      }
+      ZMOVS(m);
+      ZPUTS(zea2, zlen2, zcp2, zclen2, zspace, m);
       break;
 
     case 1:  /* insert character M */
@@ -5804,17 +7514,13 @@ d_zed:  /* 001111 */
     case 2:  /* skip M characters */
       if (m >= zlen1)
 	zlen1 = 0;
-      else while (m) {
-	ZGETC(zea1, zlen1, zcp1, zclen1, zch1);
-	m--;
+      else {
+	ZSKIPS(zea1, zlen1, zcp1, zclen1, m);
       }
       break;
 
     case 3:  /* insert M blanks */
-      while (m) {
-	ZPUTC(zea2, zlen2, zcp2, zclen2, zspace);
-	m--;
-      }
+      ZPUTS(zea2, zlen2, zcp2, zclen2, zspace, m);
       break;
 
     default:
@@ -5852,8 +7558,9 @@ d_xed:  /* 001112 */
   xsign = (zch1 == XMINUS);
   xsig = 0;
   ea = getcrs32ea(XB);
+  ZEDMAP(ea);
   for (i=0; i < 32767; i++) {     /* do edit pgms have a size limit? */
-    utempa = get16(INCVA(ea, i));
+    utempa = ZEDWORD(ea, i);
     m = utempa & 0xFF;
     //printf("\nxed: %d: opcode = %o, m=%o\n", i, (utempa>>8) & 037, m);
     switch ((utempa >> 8) & 037) {
@@ -5894,11 +7601,7 @@ d_xed:  /* 001112 */
       if (!xsig && xfc) {
 	ZPUTC(zea2, zlen2, zcp2, zclen2, xfc);
       }
-      while (m) {
-	ZGETC(zea1, zlen1, zcp1, zclen1, zch1);
-	ZPUTC(zea2, zlen2, zcp2, zclen2, zch1);
-	m--;
-      }
+      ZMOVS(m);
       xsig = 1;
       break;
 
@@ -5949,10 +7652,7 @@ d_xed:  /* 001112 */
       break;
 
     case 014:  /* fill with suppress */
-      while (m) {
-	ZPUTC(zea2, zlen2, zcp2, zclen2, xsc);
-	m--;
-      }
+      ZPUTS(zea2, zlen2, zcp2, zclen2, xsc, m);
       break;
 
     case 015:  /* set significance */
@@ -6013,7 +7713,7 @@ d_xed:  /* 001112 */
   */
 
 d_xuii:
-  TRACE(T_FLOW, " XUII: %s\n", inst==01100?"XAD":inst==01101?"XMV":inst==01102?"XMV":inst==01104?"XMP":inst==01107?"XDV":inst==01145?"XBTD":inst==01146?"XDTB":"UNKN");
+  TRACE(T_FLOW, " XUII: %s\n", inst==01100?"XAD":inst==01101?"XMV":inst==01102?"XCM":inst==01104?"XMP":inst==01107?"XDV":inst==01145?"XBTD":inst==01146?"XDTB":"UNKN");
   fault(UIIFAULT, RPL, RP);
   fatal("Return from XZUII fault");
 
@@ -6068,9 +7768,10 @@ d_liot:  /* 000044 */
   TRACE(T_FLOW, " LIOT\n");
   RESTRICT();
   ea = apea(NULL);
-  utempa = STLBIX(ea);
-  gv.stlb[utempa].seg = 0xFFFF;
-  TRACE(T_TLB, "stlb[%d] invalidated at %o/%o for liot\n", utempa, RPH, RPL);
+  utempa = STLBSET(ea);
+  stlbinvset(utempa);
+  sdwcinvseg(ea);
+  TRACE(T_TLB, "stlb set %d invalidated at %o/%o for liot\n", utempa, RPH, RPL);
   mapva(ea, RP, RACC, &access);
   TRACE(T_INST, " loaded STLB for %o/%o\n", ea>>16, ea&0xffff);
   invalidate_brp();
@@ -6081,12 +7782,25 @@ d_ptlb:  /* 000064 */
   TRACE(T_FLOW, " PTLB\n");
   RESTRICT();
   utempl = getcrs32(L);
-  for (utempa = 0; utempa < STLBENTS; utempa++)
-    if ((utempl & 0x80000000) || gv.stlb[utempa].ppa == (utempl << 10)) {
-      TRACE(T_TLB, "stlb[%d] invalidated at %o/%o for ptlb\n", utempa, RPH, RPL);
+
+  /* the predecode cache is physically addressed, but PTLB means a
+     page frame is being reused, so drop any decoded instructions.
+     For one page, only the brp and htlb entries for it are dropped */
+
+  if (utempl & 0x80000000) {
+    for (utempa = 0; utempa < ((gv.stlbsetmask+1) << gv.stlbwshift); utempa++)
       gv.stlb[utempa].seg = 0xFFFF;
-    }
-  invalidate_brp();
+    TRACE(T_TLB, "stlb purged at %o/%o by PTLB\n", RPH, RPL);
+    pdcinvall();
+    sdwcinvall();
+    ecbcinvall();
+    pxrcinvall();
+    invalidate_brp();
+  } else {
+    stlbinvpage(utempl << 10);
+    pdcinvpage(utempl << 10);
+    brpinvpage(utempl << 10);
+  }
   goto fetch;
 
 d_itlb:  /* 000615 */
@@ -6102,13 +7816,18 @@ d_itlb:  /* 000615 */
   */
 
   if (utempl == 0x10000) {
-    for (utempa = 0; utempa < STLBENTS; utempa++)
+    for (utempa = 0; utempa < ((gv.stlbsetmask+1) << gv.stlbwshift); utempa++)
       gv.stlb[utempa].seg = 0xFFFF;
+    pdcinvall();
+    sdwcinvall();
+    ecbcinvall();
+    pxrcinvall();
     TRACE(T_TLB, "stlb purged at %o/%o by ITLB\n", RPH, RPL);
   } else {
-    utempa = STLBIX(utempl);
-    gv.stlb[utempa].seg = 0xFFFF;
-    TRACE(T_TLB, "stlb[%d] invalidated at %o/%o by ITLB for %o/%o\n", utempa, RPH, RPL, utempl>>16, utempl&0xFFFF);
+    utempa = STLBSET(utempl);
+    stlbinvset(utempa);
+    sdwcinvseg(utempl);
+    TRACE(T_TLB, "stlb set %d invalidated at %o/%o by ITLB for %o/%o\n", utempa, RPH, RPL, utempl>>16, utempl&0xFFFF);
     if (((utempl >> 16) & 07777) < 4) {
       gv.iotlb[(utempl >> 10) & 0xFF].valid = 0;
       TRACE(T_TLB, "iotlb[%d] invalidated at %o/%o by ITLB for %o/%o\n", utempa, RPH, RPL, utempl>>16, utempl&0xFFFF);
@@ -6201,32 +7920,32 @@ d_cai:  /* 000411 */
 
 d_sgl:  /* 000005 */
   TRACE(T_FLOW, " SGL\n");
-  putcrs16(KEYS, getcrs16(KEYS) & ~040000);
+  putkeys(getkeys() & ~040000);
   goto fetch;
 
 d_e16s:  /* 000011 */
   TRACE(T_FLOW, " E16S\n");
-  newkeys(getcrs16(KEYS) & 0161777);
+  newkeys(getkeys() & 0161777);
   goto fetch;
 
 d_e32s:  /* 000013 */
   TRACE(T_FLOW, " E32S\n");
-  newkeys((getcrs16(KEYS) & 0161777) | 1<<10);
+  newkeys((getkeys() & 0161777) | 1<<10);
   goto fetch;
 
 d_e32r:  /* 001013 */
   TRACE(T_FLOW, " E32R\n");
-  newkeys((getcrs16(KEYS) & 0161777) | 3<<10);
+  newkeys((getkeys() & 0161777) | 3<<10);
   goto fetch;
 
 d_e64r:  /* 001011 */
   TRACE(T_FLOW, " E64R\n");
-  newkeys((getcrs16(KEYS) & 0161777) | 2<<10);
+  newkeys((getkeys() & 0161777) | 2<<10);
   goto fetch;
 
 d_e64v:  /* 000010 */
   TRACE(T_FLOW, " E64V\n");
-  newkeys((getcrs16(KEYS) & 0161777) | 6<<10);
+  newkeys((getkeys() & 0161777) | 6<<10);
   goto fetch;
 
 d_e32i:  /* 001010 */
@@ -6241,7 +7960,7 @@ d_e32i:  /* 001010 */
   if (cpuid < 4)
     fault(RESTRICTFAULT, 0, 0);
   else
-    newkeys((getcrs16(KEYS) & 0161777) | 4<<10);
+    newkeys((getkeys() & 0161777) | 4<<10);
   goto fetch;
 
 d_svc:  /* 000505 */
@@ -6331,7 +8050,7 @@ d_dbl:  /* 000007 (R-mode) */
   */
 
   TRACE(T_FLOW, " DBL\n");
-  putcrs16(KEYS, getcrs16(KEYS) | 040000);
+  putkeys(getkeys() | 040000);
   goto fetch;
 
 d_sca:  /* 000041 */
@@ -6341,12 +8060,12 @@ d_sca:  /* 000041 */
 
 d_inkr:  /* 000043 */
   TRACE(T_FLOW, " INKr\n");
-  putcrs16(A, (getcrs16(KEYS) & 0xFF00) | (getcrs16(VSC) & 0xFF));
+  putcrs16(A, (getkeys() & 0xFF00) | (getcrs16(VSC) & 0xFF));
   goto fetch;
 
 d_otkr:  /* 000405 */
   TRACE(T_FLOW, " OTKr\n");
-  newkeys((getcrs16(A) & 0xFF00) | (getcrs16(KEYS) & 0xFF));
+  newkeys((getcrs16(A) & 0xFF00) | (getkeys() & 0xFF));
   putcrs16(VSC, (getcrs16(VSC) & 0xFF00) | (getcrs16(A) & 0xFF));
   if ((RP & RINGMASK32) == 0)
     gv.inhcount = 1;
@@ -6439,7 +8158,7 @@ d_bcgt:  /* 0141601 */
 
 d_bcr:  /* 0141705 */
   TRACE(T_FLOW, " BCR\n");
-  if (!(getcrs16(KEYS) & 0100000))
+  if (!(getkeys() & 0100000))
     RPL = iget16(RP);
   else
     INCRP;
@@ -6447,7 +8166,7 @@ d_bcr:  /* 0141705 */
 
 d_bcs:  /* 0141704 */
   TRACE(T_FLOW, " BCS\n");
-  if (getcrs16(KEYS) & 0100000)
+  if (getkeys() & 0100000)
     RPL = iget16(RP);
   else
     INCRP;
@@ -6455,7 +8174,7 @@ d_bcs:  /* 0141704 */
 
 d_blr:  /* 0141707 */
   TRACE(T_FLOW, " BMLT/BLR\n");
-  if (!(getcrs16(KEYS) & 020000))
+  if (!(getkeys() & 020000))
     RPL = iget16(RP);
   else
     INCRP;
@@ -6621,21 +8340,20 @@ d_bdx:  /* 0140734 */
       if (!firstbdx) {
 	//printf("%o ", getcrs16(OWNERL)); fflush(stdout);
 	utempl = gv.instpermsec*100;    /* limit delay to 100 msecs */
-	for (i=0; i<64; i++)              /* check device timers */
-	  if (devpoll[i])                 /* poll set? */
-	    if (devpoll[i] <= 100) {      /* too fast! */
-	      utempl = 1;
-	      break;
-	    } else if (devpoll[i] < utempl)
-	      utempl = devpoll[i];
+	i = nextdevpoll();              /* check device timers */
+	if (i)                          /* poll set? */
+	  if (i <= 100)                 /* too fast! */
+	    utempl = 1;
+	  else if (i < utempl)
+	    utempl = i;
       } else {
 	firstbdx = 0;
 	utempl = 1;
       }
 
       /* this decrement ensures that if a device had a poll pending,
-	 we won't decrement it to zero below, ie, it'll still fire
-	 in the main loop */
+	 we wake up just before it's due, ie, it'll still fire in the
+	 main loop */
 
       utempl--;                         /* utempl = # instructions */
 
@@ -6667,11 +8385,10 @@ d_bdx:  /* 0140734 */
 	}
 #endif
 	/* do timer bookkeeping that would have occurred if we had 
-	   actually looped on BDX utempl times */
+	   actually looped on BDX utempl times.  Device polls are due at
+	   absolute instruction counts, so bumping instcount below
+	   advances them too */
 
-	for (i=0; i<64; i++)
-	  if (devpoll[i] > 0)
-	    devpoll[i] -= utempl;
 	if (actualmsec > 0) {
 	  utempa = getcrs16(TIMERH);
 	  putcrs16(TIMERH, getcrs16(TIMERH) + actualmsec);
@@ -6704,9 +8421,9 @@ d_a2a:  /* 0140304 */
 
 d_aca:  /* 0141216 */
   TRACE(T_FLOW, " ACA\n");
-  if (getcrs16(KEYS) & 0100000)
+  if (getkeys() & 0100000)
     goto a1a;
-  putcrs16(KEYS, getcrs16(KEYS) & ~0120300);     /* clear C, L, LT, EQ */
+  putkeys(getkeys() & ~0120300);     /* clear C, L, LT, EQ */
   SETCC_A;
   goto fetch;
 
@@ -6770,7 +8487,7 @@ d_crl:  /* 0140010 */
 d_caz:  /* 0140214 */
   TRACE(T_FLOW, " CAZ\n");
   /* set keys like CAS =0 would (subtract) */
-  putcrs16(KEYS, (getcrs16(KEYS) & ~0100) | 020200);   /* clear EQ, set L, LT */
+  putkeys((getkeys() & ~0100) | 020200);   /* clear EQ, set L, LT */
   if (getcrs16(A) == 0) {                  /* if zero, set EQ */
     SETEQ;
     INCRP;
@@ -6873,12 +8590,12 @@ d_tcl:  /* 0141210 */
 
 d_scb:  /* 0140600 */
   TRACE(T_FLOW, " SCB\n");
-  putcrs16(KEYS, getcrs16(KEYS) | 0100000);
+  putkeys(getkeys() | 0100000);
   goto fetch;
 
 d_rcb:  /* 0140200 */
   TRACE(T_FLOW, " RCB\n");
-  putcrs16(KEYS, getcrs16(KEYS) & 077777);
+  putkeys(getkeys() & 077777);
   goto fetch;
 
 d_chs:  /* 0140024 */
@@ -6903,7 +8620,7 @@ d_cma:  /* 0140401 */
 
 d_csa:  /* 0140320 */
   TRACE(T_FLOW, " CSA\n");
-  putcrs16(KEYS, (getcrs16(KEYS) & 077777) | (getcrs16(A) & 0x8000));
+  putkeys((getkeys() & 077777) | (getcrs16(A) & 0x8000));
   putcrs16(A, getcrs16(A) & 077777);
   goto fetch;
 
@@ -7110,7 +8827,7 @@ d_fsgt:  /* 0140515 */
 d_int:  /* 0140554 */
   TRACE(T_FLOW, " INTr\n");
   /* XXX: do -1073741824.5 and 1073741823.5 work on Prime, or overflow? */
-  if (prieee8(getfr64(2), &tempd) && -1073741824.0 <= tempd && tempd <= 1073741823.0) {
+  if (facget(2, &tempd) && -1073741824.0 <= tempd && tempd <= 1073741823.0) {
     templ = tempd;
     putcrs16(B, templ & 0x7FFF);
     putcrs16(A, templ >> 15);
@@ -7122,7 +8839,7 @@ d_int:  /* 0140554 */
 d_inta:  /* 0140531 */
   TRACE(T_FLOW, " INTA\n");
   /* XXX: do 32767.5 and -32768.5 work on Prime, or overflow? */
-  if (prieee8(getfr64(2), &tempd) && -32768.0 <= tempd && tempd <= 32767.0) {
+  if (facget(2, &tempd) && -32768.0 <= tempd && tempd <= 32767.0) {
     putcrs16(A, (short)tempd);
     CLEARC;
   } else
@@ -7132,12 +8849,12 @@ d_inta:  /* 0140531 */
 d_flta:  /* 0140532 */
   TRACE(T_FLOW, " FLTA\n");
   tempd = getcrs16s(A);
-  ieeepr8(tempd, (long long *)(crs+FLTH), 0);
+  facput(tempd, 2, 0);
   goto fetch;
 
 d_intl:  /* 0140533 */
   TRACE(T_FLOW, " INTL\n");
-  if (prieee8(getfr64(2), &tempd) && -2147483648.0 <= tempd && tempd <= 2147483647.0) {
+  if (facget(2, &tempd) && -2147483648.0 <= tempd && tempd <= 2147483647.0) {
     putcrs32s(L, (int)tempd);
     CLEARC;
   } else
@@ -7151,7 +8868,7 @@ d_fltl:  /* 0140535 */
 
 d_bmle:  /* 0141711 */
   TRACE(T_FLOW, " BMLE\n");
-  if (!(getcrs16(KEYS) & 020000))
+  if (!(getkeys() & 020000))
     RPL = iget16(RP);
   else
     BCEQ;
@@ -7176,7 +8893,7 @@ d_bmge:  /* 0141606 */
 
 d_bmgt:  /* 0141710 */
   TRACE(T_FLOW, " BMGT\n");
-  if (getcrs16(KEYS) & 020000)
+  if (getkeys() & 020000)
     BCNE;
   else
     INCRP;
@@ -7216,7 +8933,7 @@ d_quii:
 d_rtq:  /* 0141714 */
   TRACE(T_FLOW, " RTQ\n");
   ea = apea(NULL);
-  if (rtq(ea, crs+A, RP))   /* does swap on store */
+  if (rtq(ea, crs+RF16(A), RP))
     CLEAREQ;
   else
     SETEQ;
@@ -7225,7 +8942,7 @@ d_rtq:  /* 0141714 */
 d_rbq:  /* 0141715 */
   TRACE(T_FLOW, " RBQ\n");
   ea = apea(NULL);
-  if (rbq(ea, crs+A, RP))  /* does swap on store */
+  if (rbq(ea, crs+RF16(A), RP))
     CLEAREQ;
   else
     SETEQ;
@@ -7408,7 +9125,7 @@ d_lls:  /* 01100 - LLS (different in R/V modes) */
       putcrs32(A, utempa);   /* XXX: this looks wrong - JW 10/14/2011 */
     }
   }
-  if ((getcrs16(KEYS) & 0100400) == 0100400)
+  if ((getkeys() & 0100400) == 0100400)
     mathexception('i', FC_INT_OFLOW, 0);
   goto fetch;
 
@@ -7425,7 +9142,7 @@ d_all:  /* 01400 - ALL */
 d_als:  /* 01500 - ALS */
   TRACE(T_FLOW, " ALS %d\n", shiftcount(inst));
   putcrs16(A, als(getcrs16(A), inst));
-  if ((getcrs16(KEYS) & 0100400) == 0100400)
+  if ((getkeys() & 0100400) == 0100400)
     mathexception('i', FC_INT_OFLOW, 0);
   goto fetch;
 
@@ -7501,13 +9218,13 @@ d_sgt:  /* 0100220 */
 
 d_ssc:  /* 0101001 */
   TRACE(T_FLOW, " SSC\n");
-  if (getcrs16(KEYS) & 0100000)
+  if (getkeys() & 0100000)
     INCRP;
   goto fetch;
 
 d_src:  /* 0100001 */
   TRACE(T_FLOW, " SRC\n");
-  if (!(getcrs16(KEYS) & 0100000))
+  if (!(getkeys() & 0100000))
     INCRP;
   goto fetch;
 
@@ -7867,7 +9584,7 @@ imode:
 
     case 0041:
       TRACE(T_FLOW, " CSR\n");
-      putcrs16(KEYS, (getcrs16(KEYS) & 0x7FFF) | (getgr16(dr) & 0x8000));
+      putkeys((getkeys() & 0x7FFF) | (getgr16(dr) & 0x8000));
       putgr32(dr, getgr32(dr) & 0x7FFFFFFF);
       break;
 
@@ -8008,12 +9725,12 @@ dfcmdr:
 
     case 0070:
       TRACE(T_FLOW, " INK\n");
-      putgr16(dr, getcrs16(KEYS));    /* IXX: says to read S register? */
+      putgr16(dr, getkeys());    /* IXX: says to read S register? */
       break;
 
     case 0103:
       TRACE(T_FLOW, " INT 0\n");
-      if (prieee8(getfr64(0), &tempd) && -2147483648.0 <= tempd && tempd <= 2147483647.0) {
+      if (facget(0, &tempd) && -2147483648.0 <= tempd && tempd <= 2147483647.0) {
 	putgr32s(dr, (int)tempd);
 	CLEARC;
       } else
@@ -8022,7 +9739,7 @@ dfcmdr:
 
     case 0113:
       TRACE(T_FLOW, " INT 1\n");
-      if (prieee8(getfr64(2), &tempd) && -2147483648.0 <= tempd && tempd <= 2147483647.0) {
+      if (facget(2, &tempd) && -2147483648.0 <= tempd && tempd <= 2147483647.0) {
 	putgr32s(dr, (int)tempd);
 	CLEARC;
       } else
@@ -8031,7 +9748,7 @@ dfcmdr:
 
     case 0101:
       TRACE(T_FLOW, " INTH 0\n");
-      if (prieee8(getfr64(0), &tempd) && -32768.0 <= tempd && tempd <= 32767.0) {
+      if (facget(0, &tempd) && -32768.0 <= tempd && tempd <= 32767.0) {
 	putgr16s(dr, (short)tempd);
 	CLEARC;
       } else
@@ -8040,7 +9757,7 @@ dfcmdr:
 
     case 0111:
       TRACE(T_FLOW, " INTH 1\n");
-      if (prieee8(getfr64(2), &tempd) && -32768.0 <= tempd && tempd <= 32767.0) {
+      if (facget(2, &tempd) && -32768.0 <= tempd && tempd <= 32767.0) {
 	putgr16s(dr, (short)tempd);
 	CLEARC;
       } else
@@ -8284,7 +10001,7 @@ dfcmdr:
     case 0133:
       TRACE(T_FLOW, " RBQ\n");
       ea = apea(NULL);
-      if (rbq(ea, crs+dr*2, RP))
+      if (rbq(ea, crs+RF16(dr*2), RP))
 	CLEAREQ;
       else
 	SETEQ;
@@ -8293,7 +10010,7 @@ dfcmdr:
     case 0132:
       TRACE(T_FLOW, " RTQ\n");
       ea = apea(NULL);
-      if (rtq(ea,crs+dr*2,RP))
+      if (rtq(ea, crs+RF16(dr*2), RP))
 	CLEAREQ;
       else
 	SETEQ;
@@ -8630,12 +10347,12 @@ dfcmdr:
     switch ((ea >> 14) & 3) {
     case 0:
       putgr32(dr, lls(getgr32(dr), ea));
-      if ((getcrs16(KEYS) & 0100400) == 0100400)
+      if ((getkeys() & 0100400) == 0100400)
 	mathexception('i', FC_INT_OFLOW, 0);
       break;
     case 1:
       putgr16(dr, als(getgr16(dr), ea));
-      if ((getcrs16(KEYS) & 0100400) == 0100400)
+      if ((getkeys() & 0100400) == 0100400)
 	mathexception('i', FC_INT_OFLOW, 0);
       break;
     case 2:
@@ -8696,9 +10413,9 @@ dfcmdr:
 	  tempa1 = getgr32(FAC0+dr+1) & 0xffff;
 	  tempa2 = immu64 & 0xffff;
 	  if (abs(tempa1-tempa2) < 48)
-	    if (prieee8(getfr64(dr), &tempd1) 
+	    if (facget(dr, &tempd1) 
 		&& prieee8(immu64, &tempd2)
-		&& ieeepr8(tempd1+tempd2, (long long *)(crsl+FAC0+dr), 0))
+		&& facput(tempd1+tempd2, dr, 0))
 	      CLEARC;
 	    else
 	      mathexception('f', FC_SFP_OFLOW, ea);
@@ -8718,9 +10435,9 @@ dfcmdr:
 	immu64 = get64(ea);
       if (immu64 & 0xFFFFFFFF00000000LL)
 	if (getgr32s(FAC0+dr))
-	  if (prieee8(getfr64(dr), &tempd1) 
+	  if (facget(dr, &tempd1) 
 	      && prieee8(immu64, &tempd2)
-	      && ieeepr8(tempd1+tempd2, (long long *)(crsl+FAC0+dr), 0))
+	      && facput(tempd1+tempd2, dr, 0))
 	    CLEARC;
 	  else
 	    mathexception('f', FC_DFP_OFLOW, ea);
@@ -8810,9 +10527,9 @@ dfcmdr:
 	  tempa1 = getgr32(FAC0+dr+1) & 0xffff;
 	  tempa2 = immu64 & 0xffff;
 	  if (abs(tempa1-tempa2) < 48)
-	    if (prieee8(getfr64(dr), &tempd1) 
+	    if (facget(dr, &tempd1) 
 		&& prieee8(immu64, &tempd2)
-	        && ieeepr8(tempd1-tempd2, (long long *)(crsl+FAC0+dr), 0))
+	        && facput(tempd1-tempd2, dr, 0))
 	      CLEARC;
 	    else
 	      mathexception('f', FC_SFP_OFLOW, ea);
@@ -8836,9 +10553,9 @@ dfcmdr:
 	immu64 = get64(ea);
       if (immu64 & 0xFFFFFFFF00000000LL)
 	if (getgr32s(FAC0+dr))
-	  if (prieee8(getfr64(dr), &tempd1) 
+	  if (facget(dr, &tempd1) 
 	      && prieee8(immu64, &tempd2)
-	      && ieeepr8(tempd1-tempd2, (long long *)(crsl+FAC0+dr), 0))
+	      && facput(tempd1-tempd2, dr, 0))
 	    CLEARC;
 	  else
 	    mathexception('f', FC_DFP_OFLOW, ea);
@@ -8861,8 +10578,8 @@ dfcmdr:
 	}
 	if (immu64 & 0xFFFFFFFF00000000LL)
 	  if (prieee8(immu64, &tempd2) 
-	      && prieee8(getfr64(dr), &tempd1)
-	      && ieeepr8(tempd1*tempd2, (long long *)(crsl+FAC0+dr), 0))
+	      && facget(dr, &tempd1)
+	      && facput(tempd1*tempd2, dr, 0))
 	    CLEARC;
 	  else
 	    mathexception('f', FC_SFP_OFLOW, ea);
@@ -8881,8 +10598,8 @@ dfcmdr:
 	  immu64 = get64(ea);
 	if (immu64 & 0xFFFFFFFF00000000LL)
 	  if (prieee8(immu64, &tempd2) 
-	      && prieee8(getfr64(dr), &tempd1)
-	      && ieeepr8(tempd1*tempd2, (long long *)(crsl+FAC0+dr), 0))
+	      && facget(dr, &tempd1)
+	      && facput(tempd1*tempd2, dr, 0))
 	    CLEARC;
 	  else
 	    mathexception('f', FC_DFP_OFLOW, ea);
@@ -8959,8 +10676,8 @@ dfcmdr:
       if (immu64 & 0xFFFFFFFF00000000LL)
 	if (getgr32s(FAC0+dr))
 	  if (prieee8(immu64, &tempd2) 
-	      && prieee8(getfr64(dr), &tempd1)
-	      && ieeepr8(tempd1/tempd2, (long long *)(crsl+FAC0+dr), 1))
+	      && facget(dr, &tempd1)
+	      && facput(tempd1/tempd2, dr, 1))
 	    CLEARC;
 	  else
 	    mathexception('f', FC_SFP_OFLOW, ea);
@@ -8979,8 +10696,8 @@ dfcmdr:
       if (immu64 & 0xFFFFFFFF00000000LL)
 	if (getgr32s(FAC0+dr))
 	  if (prieee8(immu64, &tempd2) 
-	      && prieee8(getfr64(dr), &tempd1)
-	      && ieeepr8(tempd1/tempd2, (long long *)(crsl+FAC0+dr), 1))
+	      && facget(dr, &tempd1)
+	      && facput(tempd1/tempd2, dr, 1))
 	    CLEARC;
 	  else
 	    mathexception('f', FC_DFP_OFLOW, ea);
@@ -8994,6 +10711,7 @@ dfcmdr:
     case 5:  /* QFST */
     case 6:  /* QFSB */
     case 7:  /* QFAD */
+      TRACE(T_FLOW, " %s\n", dr==4?"QFLD":dr==5?"QFST":dr==6?"QFSB":"QFAD");
       fault(UIIFAULT, RPL, RP);
 
     default:
@@ -9052,15 +10770,15 @@ dfcmdr:
       utempl1 = EACP(getgr32(dr));
       utempl2 = EACP(immu32);
       if (utempl1 < utempl2)
-	putcrs16(KEYS, getcrs16(KEYS) & ~0300 | 0200);
+	putkeys(getkeys() & ~0300 | 0200);
       else if (utempl1 == utempl2)
-	putcrs16(KEYS, getcrs16(KEYS) & ~0300 | 0100);
+	putkeys(getkeys() & ~0300 | 0100);
       else
-	putcrs16(KEYS, getcrs16(KEYS) & ~0300);
+	putkeys(getkeys() & ~0300);
     } else {
       TRACE(T_FLOW, " LCC\n");
       utempa = get16(ea);
-      TRACE(T_INST, " before load, keys=%o, ea=%o/%o, [ea]=0x%x, dr=%d, [dr]=0x%x\n", getcrs16(KEYS), ea>>16, ea&0xFFFF, utempa, dr, getgr32(dr));
+      TRACE(T_INST, " before load, keys=%o, ea=%o/%o, [ea]=0x%x, dr=%d, [dr]=0x%x\n", getkeys(), ea>>16, ea&0xFFFF, utempa, dr, getgr32(dr));
       if (ea & EXTMASK32)
 	utempa &= 0xFF;
       else
@@ -9070,7 +10788,7 @@ dfcmdr:
 	SETEQ;
       else
 	CLEAREQ;
-      TRACE(T_INST, " after load, keys=%o, ea=%o/%o, utempa=0x%x, dr=%d, [dr]=0x%x\n", getcrs16(KEYS), ea>>16, ea&0xFFFF, utempa, dr, getgr32(dr));
+      TRACE(T_INST, " after load, keys=%o, ea=%o/%o, utempa=0x%x, dr=%d, [dr]=0x%x\n", getkeys(), ea>>16, ea&0xFFFF, utempa, dr, getgr32(dr));
     }
     goto fetch;
 
@@ -9146,7 +10864,7 @@ imodepcl:
       break;
 
     default:
-      warn("I-mode 006 switch?");
+      warn("I-mode 046 switch?");
       fault(ILLINSTFAULT, RPL, RP);
     }
     goto fetch;
@@ -9266,10 +10984,10 @@ imodepcl:
       utempl = immu32;
     else
       utempl = get32(ea);
-    putcrs16(KEYS, getcrs16(KEYS) & ~020300);     /* clear L, EQ LT */
+    putkeys(getkeys() & ~020300);     /* clear L, EQ LT */
     utempll = getgr32(dr);
     if ((utempll + (~utempl & 0xFFFFFFFF) + 1) & 0x100000000LL)
-      putcrs16(KEYS, getcrs16(KEYS) | 020000);
+      putkeys(getkeys() | 020000);
     if (getgr32(dr) == utempl)
       SETEQ;
     else if (getgr32s(dr) < *(int *)&utempl)
@@ -9358,10 +11076,10 @@ imodepcl:
       utempa = (immu32 >> 16);
     else
       utempa = get16(ea);
-    putcrs16(KEYS, getcrs16(KEYS) & ~020300);
+    putkeys(getkeys() & ~020300);
     utempl = getgr16(dr);
     if ((utempl + (~utempa & 0xFFFF) + 1) & 0x10000)
-      putcrs16(KEYS, getcrs16(KEYS) | 020000);
+      putkeys(getkeys() | 020000);
     if (getgr16(dr) == utempa)
       SETEQ;
     else if (getgr16s(dr) < *(short *)&utempa)
@@ -9507,7 +11225,7 @@ d_adddad:  /* 00600 (R-mode) */
   if (!(getcrs16(KEYS) & 040000))      /* dbl mode? */
     goto d_add;
   TRACE(T_FLOW, " DAD\n");
-  putcrs16(KEYS, getcrs16(KEYS) & ~0120300);   /* clear C, L, LT, EQ */
+  putkeys(getkeys() & ~0120300);   /* clear C, L, LT, EQ */
   utempa = getcrs16(A);
   m = get16t(ea);
   putcrs16(B, getcrs16(B) + get16t(INCVA(ea,1)));
@@ -9519,7 +11237,7 @@ d_adddad:  /* 00600 (R-mode) */
   utempl += m;
   putcrs16(A, utempl);
   if (utempl & 0x10000)                  /* set L-bit if carry */
-    putcrs16(KEYS, getcrs16(KEYS) | 020000);
+    putkeys(getkeys() | 020000);
   /* NOTE: this EQ test prevents reusing the ADD code :( */
   if (getcrs32s(L) == 0)              /* set EQ? */
     SETEQ; 
@@ -9542,7 +11260,7 @@ d_subdsb:  /* 00700 */
   if (!(getcrs16(KEYS) & 040000))
     goto d_sub;
   TRACE(T_FLOW, " DSB\n");
-  putcrs16(KEYS, getcrs16(KEYS) & ~0120300);   /* clear C, L, and CC */
+  putkeys(getkeys() & ~0120300);   /* clear C, L, and CC */
   utempa = getcrs16(A);
   m = get16t(ea);
   putcrs16(B, getcrs16(B) - get16t(INCVA(ea,1)));
@@ -9555,7 +11273,7 @@ d_subdsb:  /* 00700 */
   utempl += 1;
   putcrs16(A, utempl);                   /* truncate results */
   if (utempl & 0x10000)                  /* set L-bit if carry */
-    putcrs16(KEYS, getcrs16(KEYS) | 020000);
+    putkeys(getkeys() | 020000);
   if (getcrs32s(L) == 0)              /* set EQ? */
     SETEQ; 
   if (((utempa ^ m) & (utempa ^ getcrs16(A))) & 0x8000) {
@@ -9602,14 +11320,14 @@ d_cas:  /* 01100 */
      most programs never tested these after CAS.  add16 can't be
      used because docs say CAS leaves C-bit unchanged... :( */
 
-  putcrs16(KEYS, getcrs16(KEYS) & ~020300);   /* clear L, and CC */
+  putkeys(getkeys() & ~020300);   /* clear L, and CC */
   utempa = getcrs16(A);
   utempl = getcrs16(A);
   utempl += (unsigned short) ~m;
   utempl += 1;
   putcrs16(A, utempl);                   /* truncate results */
   if (utempl & 0x10000)                  /* set L-bit if carry */
-    putcrs16(KEYS, getcrs16(KEYS) | 020000);  
+    putkeys(getkeys() | 020000);  
   if (getcrs16(A) == 0)                  /* set EQ? */
     SETEQ; 
   if (((utempa ^ m) & (utempa ^ getcrs16(A))) & 0x8000) {
@@ -9908,9 +11626,9 @@ d_fad:  /* 00601 */
       tempa1 = getcrs16(FEXP);
       tempa2 = immu64 & 0xffff;
       if (abs(tempa1-tempa2) < 48)
-	if (prieee8(getfr64(2), &tempd1) 
+	if (facget(2, &tempd1) 
 	    && prieee8(immu64, &tempd2)
-	    && ieeepr8(tempd1+tempd2, (long long *)(crsl+FAC1), 0))
+	    && facput(tempd1+tempd2, 2, 0))
 	  CLEARC;
 	else
 	  mathexception('f', FC_SFP_OFLOW, ea);
@@ -9937,8 +11655,8 @@ d_fdv:  /* 01701 */
   if (immu64 & 0xFFFFFFFF00000000LL)
     if (getgr32s(FAC1))
       if (prieee8(immu64, &tempd2) 
-	  && prieee8(getfr64(2), &tempd1)
-	  && ieeepr8(tempd1/tempd2, (long long *)(crsl+FAC1), 1))
+	  && facget(2, &tempd1)
+	  && facput(tempd1/tempd2, 2, 1))
 	CLEARC;
       else
 	mathexception('f', FC_SFP_OFLOW, ea);
@@ -9962,8 +11680,8 @@ d_fmp:  /* 01601 */
     immu64 = ((immu64 << 32) & 0xffffff0000000000LL) | (immu64 & 0xff);
     if (immu64 & 0xFFFFFFFF00000000LL)
       if (prieee8(immu64, &tempd2) 
-	  && prieee8(getfr64(2), &tempd1)
-	  && ieeepr8(tempd1*tempd2, (long long *)(crsl+FAC1), 0))
+	  && facget(2, &tempd1)
+	  && facput(tempd1*tempd2, 2, 0))
 	CLEARC;
       else
 	mathexception('f', FC_SFP_OFLOW, ea);
@@ -9982,9 +11700,9 @@ d_fsb:  /* 00701 */
       tempa1 = getcrs16(FEXP);
       tempa2 = immu64 & 0xffff;
       if (abs(tempa1-tempa2) < 48)
-	if (prieee8(getfr64(2), &tempd1) 
+	if (facget(2, &tempd1) 
 	    && prieee8(immu64, &tempd2)
-	    && ieeepr8(tempd1-tempd2, (long long *)(crsl+FAC1), 0))
+	    && facput(tempd1-tempd2, 2, 0))
 	  CLEARC;
 	else
 	  mathexception('f', FC_SFP_OFLOW, ea);
@@ -10021,9 +11739,9 @@ d_dfad:  /* 0602 */
   immu64 = get64(ea);
   if (immu64 & 0xFFFFFFFF00000000LL)
     if (getgr32s(FAC1))
-      if (prieee8(getfr64(2), &tempd1) 
+      if (facget(2, &tempd1) 
 	  && prieee8(immu64, &tempd2)
-	  && ieeepr8(tempd1+tempd2, (long long *)(crsl+FAC1), 0)) {
+	  && facput(tempd1+tempd2, 2, 0)) {
 	CLEARC;
 	TRACE(T_FLOW, " %f ('%o %o %o %o) + %f (%o %o %o %o)\n", tempd1, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP), tempd2, (unsigned short)(immu64>>48), (unsigned short)((immu64>>32)&0xffff), (unsigned short)((immu64>>16)&0xffff), (unsigned short)(immu64&0xffff));
 	TRACE(T_FLOW, " = %f ('%o %o %o %o)\n", tempd1+tempd2, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP));
@@ -10048,8 +11766,8 @@ d_dfdv:  /* 01702 */
   if (immu64 & 0xFFFFFFFF00000000LL)
     if (getgr32s(FAC1))
       if (prieee8(immu64, &tempd2) 
-	  && prieee8(getfr64(2), &tempd1)
-	  && ieeepr8(tempd1/tempd2, (long long *)(crsl+FAC1), 1)) {
+	  && facget(2, &tempd1)
+	  && facput(tempd1/tempd2, 2, 1)) {
 	CLEARC;
 	TRACE(T_FLOW, " %f ('%o %o %o %o) / %f (%o %o %o %o)\n", tempd1, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP), tempd2, (unsigned short)(immu64>>48), (unsigned short)((immu64>>32)&0xffff), (unsigned short)((immu64>>16)&0xffff), (unsigned short)(immu64&0xffff));
 	TRACE(T_FLOW, " = %f ('%o %o %o %o)\n", tempd1/tempd2, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP));
@@ -10065,7 +11783,7 @@ d_dfld:  /* 0202 */
   TRACE(T_FLOW, " DFLD\n");
   putcrs64s(FLTH, get64(ea));
 #ifndef NOTRACE
-  if (!prieee8(getfr64(2), &tempd1))
+  if (!facget(2, &tempd1))
     tempd1 = -0.0;
   TRACE(T_FLOW, " Loaded %f  '%o %o %o %o\n", tempd1, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP));
 #endif
@@ -10077,8 +11795,8 @@ d_dfmp:  /* 01602 */
     immu64 = get64(ea);
     if (immu64 & 0xFFFFFFFF00000000LL)
       if (prieee8(immu64, &tempd2) 
-	  && prieee8(getfr64(2), &tempd1)
-	  && ieeepr8(tempd1*tempd2, (long long *)(crsl+FAC1), 0)) {
+	  && facget(2, &tempd1)
+	  && facput(tempd1*tempd2, 2, 0)) {
 	CLEARC;
 	TRACE(T_FLOW, " %f ('%o %o %o %o) * %f (%o %o %o %o)\n", tempd1, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP), tempd2, (unsigned short)(immu64>>48), (unsigned short)((immu64>>32)&0xffff), (unsigned short)((immu64>>16)&0xffff), (unsigned short)(immu64&0xffff));
 	TRACE(T_FLOW, " = %f ('%o %o %o %o)\n", tempd1*tempd2, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP));
@@ -10095,9 +11813,9 @@ d_dfsb:  /* 0702 */
   immu64 = get64(ea);
   if (immu64 & 0xFFFFFFFF00000000LL)
     if (getgr32s(FAC1))
-      if (prieee8(getfr64(2), &tempd1) 
+      if (facget(2, &tempd1) 
 	  && prieee8(immu64, &tempd2)
-	  && ieeepr8(tempd1-tempd2, (long long *)(crsl+FAC1), 0)) {
+	  && facput(tempd1-tempd2, 2, 0)) {
 	CLEARC;
 	TRACE(T_FLOW, " %f ('%o %o %o %o) - %f (%o %o %o %o)\n", tempd1, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP), tempd2, (unsigned short)(immu64>>48), (unsigned short)((immu64>>32)&0xffff), (unsigned short)((immu64>>16)&0xffff), (unsigned short)(immu64&0xffff));
 	TRACE(T_FLOW, " = %f ('%o %o %o %o)\n", tempd1-tempd2, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP));
@@ -10115,7 +11833,7 @@ d_dfst:  /* 0402 */
   TRACE(T_FLOW, " DFST\n");
   put64(getcrs64s(FLTH), ea);
 #ifndef NOTRACE
-  if (!prieee8(getfr64(2), &tempd1))
+  if (!facget(2, &tempd1))
     tempd1 = -0.0;
   TRACE(T_FLOW, " Stored %f  '%o %o %o %o\n", tempd1, getcrs16(FLTH), getcrs16(FLTL), getcrs16(FLTD), getcrs16(FEXP));
 #endif
@@ -10153,6 +11871,7 @@ d_xec:  /* 00102 */
   //printf("RPL %o/%o: XEC instruction %o|%o, ea is %o/%o, new inst = %o \n", utempl>>16, utempl&0xFFFF, inst, get16t(utempl+1), ea>>16, ea&0xFFFF, utempa);
   inst = utempa;
   earp = INCVA(ea,1);
+  pdcp = NULL;
   goto xec;
 
 d_entr:  /* 00103 */
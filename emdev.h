@@ -105,7 +105,7 @@
 
 #define IOSKIP \
   if (getcrs16(KEYS) & 010000)			\
-    putcrs16(KEYS, getcrs16(KEYS) | 0100);	\
+    putkeys(getkeys() | 0100);	\
   else \
     RPL++
 
@@ -187,6 +187,8 @@ int devnone (int class, int func, int device) {
 
   case -1:   /* emulator initialization */
   case -2:   /* emulator termination  */
+  case -3:   /* snapshot */
+  case -4:   /* restore */
     return 0;
 
   case 0:
@@ -314,6 +316,12 @@ int devasr (int class, int func, int device) {
     fclose(conslog);
     break;
 
+  case -3:    /* snapshot */
+  case -4:    /* restore */
+    SNAPVAR(class, vcptime);
+    SNAPVAR(class, vcptimeix);
+    return 0;
+
   case -1:    /* initialize */
     setsid();
     ttydev = open("/dev/tty", O_RDWR, 0);
@@ -462,7 +470,7 @@ int devasr (int class, int func, int device) {
 	if (needflush) {
 	  if (fflush(stdout) == 0) {
 	    needflush = 0;
-	    devpoll[device] = 0;
+	    setdevpoll(device, 0);
 	  }
 	  fflush(conslog);
 	}
@@ -581,8 +589,8 @@ readasr:
       if (ch != 015)
 	putc(ch, conslog);
       needflush = 1;
-      if (devpoll[device] == 0)
-	devpoll[device] = gv.instpermsec*100;
+      if (getdevpoll(device) == 0)
+	setdevpoll(device, gv.instpermsec*100);
       IOSKIP;
     } else if (func == 1) {       /* write control word */
       TRACEA("OTA 4, func %d, A='%o/%d\n", func, getcrs16(A), getcrs16s(A));
@@ -639,7 +647,7 @@ readasr:
       if (fflush(stdout) == 0)
 	needflush = 0;
       else
-	devpoll[device] = gv.instpermsec*100;
+	setdevpoll(device, gv.instpermsec*100);
       fflush(conslog);
     }
   }
@@ -961,6 +969,18 @@ int devmt (int class, int func, int device) {
     }
     return 0;
 
+  case -3:                    /* snapshot */
+  case -4:                    /* restore; tapes are reopened at BOT */
+    SNAPVAR(class, mtvec);
+    SNAPVAR(class, dmxchan);
+    SNAPVAR(class, datareg);
+    SNAPVAR(class, ready);
+    SNAPVAR(class, busy);
+    SNAPVAR(class, enabled);
+    SNAPVAR(class, interrupting);
+    SNAPVAR(class, usel);
+    return 0;
+
   case 0:
     TRACE(T_INST|T_TIO, " OCP '%02o%02o\n", func, device);
 
@@ -973,7 +993,7 @@ int devmt (int class, int func, int device) {
     } else if (func == 015) {             /* set interrupt mask */
       enabled = 1;
       if (interrupting == 1)              /* if interrupt is pending */
-	devpoll[device] = 10;             /* try to interrupt soon */
+	setdevpoll(device, 10);           /* try to interrupt soon */
       
     } else if (func == 016) {             /* reset interrupt mask */
       enabled = 0;
@@ -1110,7 +1130,7 @@ int devmt (int class, int func, int device) {
       /* for rewind, read, write, & space, setup a completion interrupt */
 
       interrupting = 1;
-      devpoll[device] = 10;
+      setdevpoll(device, 10);
 
       if ((getcrs16(A) & 0x00E0) == 0x0020) {       /* rewind */
 	//gv.traceflags = ~T_MAP;
@@ -1204,7 +1224,7 @@ int devmt (int class, int func, int device) {
 	  dmxnw = getar16(REGDMX16+dmxreg);
 	  dmxnw = -((dmxnw>>4) | 0xF000);
 	  dmxaddr = ((getar16(REGDMX16+dmxreg) & 3)<<16) | getar16(REGDMX16+dmxreg+1);
-	  TRACE(T_INST|T_TIO, " DMA channels: ['%o]='%o, ['%o]='%o/%o, nwords=%d", dmxreg, swap16(regs.sym.regdmx[dmxreg]), dmxreg+1, dmxaddr>>16, dmxaddr&0xffff, dmxnw);
+	  TRACE(T_INST|T_TIO, " DMA channels: ['%o]='%o, ['%o]='%o/%o, nwords=%d", dmxreg, getar16(REGDMX16+dmxreg), dmxreg+1, dmxaddr>>16, dmxaddr&0xffff, dmxnw);
 	}
 	if (dmxnw < 0) {            /* but is legal for >32K DMC transfer... */
 	  printf("devmt: requested negative DMX of size %d\n", dmxnw);
@@ -1236,6 +1256,7 @@ int devmt (int class, int func, int device) {
 	      TRACE(T_TIO, "\n %04d: ", i);
 	    TRACE(T_TIO, " %03o %03o", (unsigned)ioword>>8, ioword&0xff);
 #endif
+	    pdcinvword(mapio(dmxaddr+i));
 	    MEM[mapio(dmxaddr+i)] = *iobufp++;  /* Prime->Prime: no swap */
 	  }
 	  TRACE(T_TIO, "\n");
@@ -1299,7 +1320,7 @@ int devmt (int class, int func, int device) {
 	TRACE(T_TIO, "  Bad OTA '02 to tape drive, A='%06o, 0x$04x\n", getcrs16(A), getcrs16(A));
 	datareg = 0;
 	interrupting = 1;
-	devpoll[device] = 10;
+	setdevpoll(device, 10);
       }
       TRACE(T_TIO,  "  setup INA 0, datareg='%06o, 0x%04x\n", datareg, datareg);
       IOSKIP;
@@ -1311,7 +1332,7 @@ int devmt (int class, int func, int device) {
     } else if (func == 05) {                /* illegal - DIAG */
       TRACE(T_TIO,  " illegal DIAG OTA '05\n");
       interrupting = 1;
-      devpoll[device] = 10;
+      setdevpoll(device, 10);
       IOSKIP;
 
     } else if (func == 014) {               /* set DMX channel */
@@ -1336,11 +1357,11 @@ int devmt (int class, int func, int device) {
   case 4:
     TRACE(T_TIO,  " POLL device '%02o, enabled=%d, interrupting=%d\n", device, enabled, interrupting);
     if (enabled && (interrupting == 1)) {
-      devpoll[device] = 100;         /* assume interrupt will be deferred */
+      setdevpoll(device, 100);       /* assume interrupt will be deferred */
       if (gv.intvec == -1 && (getcrs16(MODALS) & 0100000)) {
 	TRACE(T_TIO,  " CPU interrupt to vector '%o\n", mtvec);
 	gv.intvec = mtvec;
-	devpoll[device] = 0;
+	setdevpoll(device, 0);
 	interrupting = 2;
       }
     }
@@ -1432,7 +1453,7 @@ int devcp (int class, int func, int device) {
   unsigned int elapsedms,targetticks;
   int i;
 
-#define SETCLKPOLL devpoll[device] = gv.instpermsec*(-clkpic*clkrate)/1000;
+#define SETCLKPOLL setdevpoll(device, gv.instpermsec*(-clkpic*clkrate)/1000);
 
   switch (class) {
 
@@ -1448,6 +1469,22 @@ int devcp (int class, int func, int device) {
     }
     return 0;
 
+  case -3:
+  case -4:
+    SNAPVAR(class, enabled);
+    SNAPVAR(class, clkvec);
+    SNAPVAR(class, clkpic);
+    SNAPVAR(class, clkrate);
+
+    /* on restore, the next tick restarts the clock from host time and
+       resets DATNOW if it's known */
+
+    if (class == -4) {
+      ticks = -1;
+      previnstcount = gv.instcount;
+    }
+    return 0;
+
   case 0:
     TRACE(T_INST, " OCP '%02o%02o\n", func, device);
 
@@ -1473,7 +1510,7 @@ int devcp (int class, int func, int device) {
 
     } else if (func == 016 || func == 017) {
       enabled = 0;
-      devpoll[device] = 0;
+      setdevpoll(device, 0);
 
     } else {
       printf("Unimplemented OCP device '%02o function '%02o\n", device, func);
@@ -1607,11 +1644,11 @@ int devcp (int class, int func, int device) {
 	  ticks = -1;
 	else if (ticks < targetticks)           /* behind, so catch up */
 	  if (targetticks-ticks < 100)
-	    devpoll[device] = devpoll[device]/2;  /* slow catch up */
+	    setdevpoll(device, getdevpoll(device)/2); /* slow catch up */
 	  else
-	    devpoll[device] = 1000;               /* fast catch up */
+	    setdevpoll(device, 1000);             /* fast catch up */
 	else if (ticks > targetticks)
-	  devpoll[device] = devpoll[device]*2;  /* ahead, so slow down */
+	  setdevpoll(device, getdevpoll(device)*2); /* ahead, so slow down */
 	else {                                  /* just right! */
 	  if (ticks > 1000000000) {             /* after a long time, */
 	    start_tv = tv;                      /* reset tick vars */
@@ -1646,7 +1683,7 @@ int devcp (int class, int func, int device) {
 	  prev_tv = tv;
 	}
       } else {
-	devpoll[device] = 100;         /* couldn't interrupt, try again soon */
+	setdevpoll(device, 100);       /* couldn't interrupt, try again soon */
       }
     }
     break;
@@ -1661,6 +1698,16 @@ int globdisk (char *devfile, int size, int device, int unit) {
   int globerr;
 
   snprintf(devfile, size, "disk%ou%d.*", device, unit);
+#ifdef DISKSAFE
+
+  /* with -diskbase, drive files that aren't in the current directory
+     come from the base directory, and only the overlays are here */
+
+  if (diskbase != NULL && glob(devfile, GLOB_NOSORT, NULL, &g) == GLOB_NOMATCH)
+    snprintf(devfile, size, "%s/disk%ou%d.*", diskbase, device, unit);
+  else if (diskbase != NULL)
+    globfree(&g);
+#endif
   if ((globerr=glob(devfile, GLOB_ERR|GLOB_NOSORT, NULL, &g)) != 0) {
     fprintf(stderr,"globdisk: glob returned %d opening %s\n", globerr, devfile);
     return -1;
@@ -1676,6 +1723,693 @@ int globdisk (char *devfile, int size, int device, int unit) {
 }
 
 
+/* disk I/O is done on a host thread per controller, so the CPU keeps
+   running while the host reads or writes the disk file.  An SREAD or
+   SWRITE order sets up a dio_t for the controller's thread and the
+   channel program stalls there; the thread does the whole transfer
+   with one preadv/pwritev, then kicks a device poll that reaps it and
+   continues the channel program (usually with a DINT).
+
+   DMA goes straight to memory: each DMA channel's buffer is split at
+   Prime page boundaries, so a mapped transfer becomes one iovec per
+   physical page span instead of a word-at-a-time mapio copy */
+
+#define DIO_IDLE 0                         /* no transfer in progress */
+#define DIO_BUSY 1                         /* thread is doing the transfer */
+#define DIO_DONE 2                         /* transfer done, not reaped */
+
+#define DOP_READ 0                         /* SREAD */
+#define DOP_WRITE 1                        /* SWRITE */
+#define DOP_FLUSH 2                        /* write back unit's cache */
+#define DOP_SNAP 3                         /* same, and copy its overlay */
+
+#define MAXDMACH 16
+#define DIOMAXIOV (MAXDMACH*3)             /* 1040 words span <= 3 pages */
+
+/* each disk unit has a direct-mapped cache of 2080-byte records,
+   indexed by record number, that the I/O thread goes through.  A read
+   that continues a sequential run reads ahead up to the end of the
+   cylinder (heads*spt records) with one preadv.  Writes are kept dirty
+   in the cache and written back in runs with pwritev, either when the
+   controller halts with a batch of them, or when they have been dirty
+   for DCFLUSHMS.  A dirty record is also written back when its slot is
+   needed for another record */
+
+#define DCRECBYTES 2080
+
+/* a disk unit's drive file.  In DISKSAFE builds, writes go to an
+   overlay instead of the drive file: ovl-<drive file> holds modified
+   records at their usual offsets, and ovl-<drive file>.map is a
+   bitmap of the records that are in the overlay.  Both persist across
+   runs until they are committed to the drive file or discarded with
+   -disksafe.  A record is copied up into the overlay before a partial
+   write, or before a read that spans both overlay and drive file
+   records, so every transfer is done with one preadv/pwritev.
+
+   Each snapshot also brings a copy of the overlay up to date, one per
+   checkpoint file and one for -snapshot, so the drives can be put
+   back the way they were when it's restored.  ovldirty has a bit for
+   each copy, set when a record changes in the overlay */
+
+#define OVLCOPIES 3                        /* checkpoint files, -snapshot */
+#define OVLSNAP 2                          /* copy for -snapshot */
+
+typedef struct {
+  int fd;                                  /* drive file */
+#ifdef DISKSAFE
+  int ovlfd;                               /* overlay records */
+  unsigned char *ovlmap;                   /* overlay bitmap, mmap'd */
+  int ovlrecs;                             /* # of records in bitmap */
+  char *name;                              /* drive file's base name */
+  unsigned char *ovldirty;                 /* per record, copies to update */
+  int ovlcopied;                           /* bit per copy made this run */
+#endif
+} dfile_t;
+
+#ifdef DISKSAFE
+
+#define OVLTEST(dfp,ra) ((dfp)->ovlmap[(ra)>>3] & (1 << ((ra) & 7)))
+#define OVLSET(dfp,ra) ((dfp)->ovlmap[(ra)>>3] |= (1 << ((ra) & 7)), (dfp)->ovldirty[ra] = (1 << OVLCOPIES) - 1)
+
+static int ovlcopyup(dfile_t *dfp, int ra) {
+  unsigned char buf[DCRECBYTES];
+  ssize_t nb;
+
+  if ((nb = pread(dfp->fd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES)) == -1)
+    return -1;
+  memset(buf+nb, 0, DCRECBYTES-nb);
+  if (pwrite(dfp->ovlfd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES) != DCRECBYTES)
+    return -1;
+  OVLSET(dfp, ra);
+  return 0;
+}
+
+/* open (or create) the overlay for a drive file with nrecs records.
+   With -disksafe discard, an existing overlay is thrown away; with
+   -disksafe commit, its records are first written to the drive file */
+
+static void ovlopen(dfile_t *dfp, char *devfile, int nrecs, int wp) {
+  char ovlname[MAXPATHLEN], mapname[MAXPATHLEN], *p;
+  unsigned char buf[DCRECBYTES];
+  int mapfd, mapbytes, ra, n;
+  struct stat st;
+
+  if ((p = strrchr(devfile, '/')) != NULL)
+    p++;
+  else
+    p = devfile;
+  snprintf(ovlname, sizeof(ovlname), "ovl-%s", p);
+  snprintf(mapname, sizeof(mapname), "ovl-%s.map", p);
+  if (disksafeop == DS_DISCARD) {
+    unlink(ovlname);
+    unlink(mapname);
+  }
+  if ((dfp->ovlfd = open(ovlname, O_RDWR|O_CREAT, 0644)) == -1 || (mapfd = open(mapname, O_RDWR|O_CREAT, 0644)) == -1) {
+    perror(ovlname);
+    fatal("Unable to open disk overlay files");
+  }
+  if (flock(dfp->ovlfd, LOCK_EX+LOCK_NB) == -1)
+    fatal("Disk overlay file is in use");
+  mapbytes = (nrecs+7)/8;
+  if (fstat(mapfd, &st) == -1 || (st.st_size < mapbytes && ftruncate(mapfd, mapbytes) == -1))
+    fatal("Unable to size disk overlay map");
+  dfp->ovlmap = mmap(NULL, mapbytes, PROT_READ|PROT_WRITE, MAP_SHARED, mapfd, 0);
+  if (dfp->ovlmap == MAP_FAILED)
+    fatal("Unable to mmap disk overlay map");
+  close(mapfd);
+  dfp->ovlrecs = nrecs;
+  if ((dfp->name = strdup(p)) == NULL || (dfp->ovldirty = calloc(nrecs, 1)) == NULL)
+    fatal("Unable to allocate disk overlay");
+  dfp->ovlcopied = 0;
+
+  if (disksafeop == DS_COMMIT) {
+    if (wp)
+      fatal("Can't commit disk overlay to a read-only or -diskbase drive file");
+    if (flock(dfp->fd, LOCK_EX+LOCK_NB) == -1)
+      fatal("Can't commit disk overlay: drive file is in use");
+    n = 0;
+    for (ra=0; ra<nrecs; ra++)
+      if (OVLTEST(dfp, ra)) {
+	if (pread(dfp->ovlfd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES) != DCRECBYTES
+	    || pwrite(dfp->fd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES) != DCRECBYTES) {
+	  perror(devfile);
+	  fatal("Unable to commit disk overlay");
+	}
+	n++;
+      }
+    if (fsync(dfp->fd) == -1)
+      fatal("Unable to commit disk overlay");
+    memset(dfp->ovlmap, 0, mapbytes);
+    msync(dfp->ovlmap, mapbytes, MS_SYNC);
+    ftruncate(dfp->ovlfd, 0);
+    flock(dfp->fd, LOCK_SH);
+    printf("em: committed %d records from %s to %s\n", n, ovlname, devfile);
+  }
+}
+
+static void ovlcopyname(char *name, int size, dfile_t *dfp, int map, int n) {
+  static char *suffix[OVLCOPIES] = {"0", "1", "snap"};
+
+  snprintf(name, size, "ovl-%s%s.%s", dfp->name, map ? ".map" : "", suffix[n]);
+}
+
+/* bring copy n of the overlay up to date for a snapshot stamped with
+   stamp: the records changed since the copy was last made go to
+   ovl-<drive file>.<n>, then the bitmap and stamp to
+   ovl-<drive file>.map.<n>.  The stamp is zeroed while the copy is
+   changing, so a partial copy won't restore.  Returns -1 on an error */
+
+static int ovlsave(dfile_t *dfp, int n, struct timeval *stamp) {
+  char name[MAXPATHLEN];
+  unsigned char buf[DCRECBYTES];
+  struct timeval zstamp;
+  int fd, mapfd, mapbytes, ra, bit, full;
+
+  bit = 1 << n;
+  full = !(dfp->ovlcopied & bit);
+  dfp->ovlcopied &= ~bit;
+  mapbytes = (dfp->ovlrecs+7)/8;
+  memset(&zstamp, 0, sizeof(zstamp));
+  fd = -1;
+  ovlcopyname(name, sizeof(name), dfp, 1, n);
+  if ((mapfd = open(name, O_RDWR|O_CREAT, 0644)) == -1)
+    return -1;
+  if (pwrite(mapfd, &zstamp, sizeof(zstamp), mapbytes) != sizeof(zstamp) || fsync(mapfd) == -1)
+    goto fail;
+  ovlcopyname(name, sizeof(name), dfp, 0, n);
+  if ((fd = open(name, O_RDWR|O_CREAT|(full ? O_TRUNC : 0), 0644)) == -1)
+    goto fail;
+  for (ra=0; ra<dfp->ovlrecs; ra++)
+    if ((full && OVLTEST(dfp, ra)) || (dfp->ovldirty[ra] & bit)) {
+      if (pread(dfp->ovlfd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES) != DCRECBYTES
+	  || pwrite(fd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES) != DCRECBYTES)
+	goto fail;
+      dfp->ovldirty[ra] &= ~bit;
+    }
+  if (fsync(fd) == -1
+      || pwrite(mapfd, dfp->ovlmap, mapbytes, 0) != mapbytes
+      || pwrite(mapfd, stamp, sizeof(*stamp), mapbytes) != sizeof(*stamp)
+      || fsync(mapfd) == -1)
+    goto fail;
+  close(fd);
+  close(mapfd);
+  dfp->ovlcopied |= bit;
+  return 0;
+
+fail:
+  if (fd != -1)
+    close(fd);
+  close(mapfd);
+  return -1;
+}
+
+/* on -restore, put copy n of the overlay back; it must be the copy
+   made for the snapshot, ie, have its stamp */
+
+static void ovlrestore(dfile_t *dfp, int n, struct timeval *stamp) {
+  char name[MAXPATHLEN];
+  unsigned char buf[DCRECBYTES];
+  struct timeval cstamp;
+  int fd, mapfd, mapbytes, ra;
+
+  mapbytes = (dfp->ovlrecs+7)/8;
+  ovlcopyname(name, sizeof(name), dfp, 1, n);
+  if ((mapfd = open(name, O_RDONLY)) == -1) {
+    perror(name);
+    fatal("Unable to restore disk overlay");
+  }
+  if (pread(mapfd, &cstamp, sizeof(cstamp), mapbytes) != sizeof(cstamp)
+      || memcmp(&cstamp, stamp, sizeof(cstamp)) != 0) {
+    fprintf(stderr, "em: %s wasn't made with this snapshot\n", name);
+    fatal("Unable to restore disk overlay");
+  }
+  if (pread(mapfd, dfp->ovlmap, mapbytes, 0) != mapbytes)
+    fatal("Unable to restore disk overlay");
+  close(mapfd);
+  ovlcopyname(name, sizeof(name), dfp, 0, n);
+  if ((fd = open(name, O_RDONLY)) == -1) {
+    perror(name);
+    fatal("Unable to restore disk overlay");
+  }
+  for (ra=0; ra<dfp->ovlrecs; ra++)
+    if (OVLTEST(dfp, ra))
+      if (pread(fd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES) != DCRECBYTES
+	  || pwrite(dfp->ovlfd, buf, DCRECBYTES, (off_t)ra*DCRECBYTES) != DCRECBYTES) {
+	perror(name);
+	fatal("Unable to restore disk overlay");
+      }
+  close(fd);
+  if (fsync(dfp->ovlfd) == -1)
+    fatal("Unable to restore disk overlay");
+  msync(dfp->ovlmap, mapbytes, MS_SYNC);
+}
+
+#endif
+
+static ssize_t dfrw(dfile_t *dfp, int write, struct iovec *iov, int niov, off_t offset, int nbytes) {
+#ifdef DISKSAFE
+  int ra, ra0, ra1, nset;
+  ssize_t nb;
+
+  ra0 = offset/DCRECBYTES;
+  ra1 = (offset+nbytes-1)/DCRECBYTES;
+  if (nbytes > 0 && ra1 < dfp->ovlrecs) {
+    nset = 0;
+    for (ra=ra0; ra<=ra1; ra++)
+      if (OVLTEST(dfp, ra))
+	nset++;
+    if (write) {
+      for (ra=ra0; ra<=ra1; ra++)
+	if (!OVLTEST(dfp, ra) && ((off_t)ra*DCRECBYTES < offset || (off_t)(ra+1)*DCRECBYTES > offset+nbytes))
+	  if (ovlcopyup(dfp, ra) == -1)
+	    return -1;
+      if ((nb = pwritev(dfp->ovlfd, iov, niov, offset)) == nbytes)
+	for (ra=ra0; ra<=ra1; ra++)
+	  OVLSET(dfp, ra);
+      return nb;
+    }
+    if (nset > 0) {
+      if (nset <= ra1-ra0)
+	for (ra=ra0; ra<=ra1; ra++)
+	  if (!OVLTEST(dfp, ra) && ovlcopyup(dfp, ra) == -1)
+	    return -1;
+      return preadv(dfp->ovlfd, iov, niov, offset);
+    }
+  } else if (write) {
+    errno = EFBIG;                         /* past the overlay bitmap */
+    return -1;
+  }
+#endif
+  if (write)
+    return pwritev(dfp->fd, iov, niov, offset);
+  return preadv(dfp->fd, iov, niov, offset);
+}
+
+/* a snapshot saves the identity of each open drive file, so -restore
+   can refuse files that were replaced or written after the snapshot
+   was taken */
+
+typedef struct {
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  long mtimens;
+} dfid_t;
+
+static void dfident(int fd, dfid_t *idp) {
+  struct stat st;
+
+  memset(idp, 0, sizeof(*idp));
+  if (fstat(fd, &st) == -1)
+    return;
+  idp->ino = st.st_ino;
+  idp->size = st.st_size;
+  idp->mtime = st.st_mtime;
+#ifdef OSX
+  idp->mtimens = st.st_mtimespec.tv_nsec;
+#else
+  idp->mtimens = st.st_mtim.tv_nsec;
+#endif
+}
+
+#define DCRECS 2048                        /* records cached per unit */
+#define DCMAXRA 64                         /* max records to read ahead */
+#define DCBATCH 32                         /* dirty records worth a flush */
+#define DCFLUSHMS 1000                     /* max msecs a record stays dirty */
+
+typedef struct {
+  int *tag;                                /* record in each slot, -1=empty */
+  unsigned char *dirty;                    /* true if slot is modified */
+  unsigned char *data;                     /* DCRECS records */
+  int ndirty;                              /* # of dirty slots */
+  int nextra;                              /* next record if sequential */
+  int cylrecs;                             /* heads*spt */
+} dcache_t;
+
+#define DCSLOT(ra) ((ra) % DCRECS)
+#define DCDATA(dcp,slot) ((dcp)->data + (slot)*DCRECBYTES)
+
+static void dcinit(dcache_t *dcp, int cylrecs) {
+  int i;
+
+  dcp->tag = malloc(DCRECS*sizeof(int));
+  dcp->dirty = calloc(DCRECS, 1);
+  dcp->data = malloc(DCRECS*DCRECBYTES);
+  if (dcp->tag == NULL || dcp->dirty == NULL || dcp->data == NULL)
+    fatal("Unable to allocate disk cache");
+  for (i=0; i<DCRECS; i++)
+    dcp->tag[i] = -1;
+  dcp->ndirty = 0;
+  dcp->nextra = -1;
+  dcp->cylrecs = cylrecs;
+}
+
+/* write back runs of dirty records with consecutive record numbers.
+   Slots are in record order within a run, except where a run wraps
+   from the last slot to the first.  Returns -1 on a write error */
+
+static int dcflush(dcache_t *dcp, dfile_t *dfp) {
+  struct iovec iov[DCMAXRA];
+  int slot, first, n;
+
+  if (dcp->data == NULL || dcp->ndirty == 0)
+    return 0;
+  slot = 0;
+  while (slot < DCRECS) {
+    if (!dcp->dirty[slot]) {
+      slot++;
+      continue;
+    }
+    first = slot;
+    n = 0;
+    do {
+      iov[n].iov_base = DCDATA(dcp, slot);
+      iov[n].iov_len = DCRECBYTES;
+      dcp->dirty[slot] = 0;
+      dcp->ndirty--;
+      n++;
+      slot++;
+    } while (slot < DCRECS && n < DCMAXRA && dcp->dirty[slot] && dcp->tag[slot] == dcp->tag[slot-1]+1);
+    if (dfrw(dfp, 1, iov, n, (off_t)dcp->tag[first]*DCRECBYTES, n*DCRECBYTES) != n*DCRECBYTES)
+      return -1;
+  }
+  return 0;
+}
+
+/* make slot free for a different record, writing it back if needed */
+
+static int dcevict(dcache_t *dcp, dfile_t *dfp, int slot) {
+  struct iovec iov;
+
+  if (dcp->dirty[slot]) {
+    iov.iov_base = DCDATA(dcp, slot);
+    iov.iov_len = DCRECBYTES;
+    if (dfrw(dfp, 1, &iov, 1, (off_t)dcp->tag[slot]*DCRECBYTES, DCRECBYTES) != DCRECBYTES)
+      return -1;
+    dcp->dirty[slot] = 0;
+    dcp->ndirty--;
+  }
+  dcp->tag[slot] = -1;
+  return 0;
+}
+
+/* read records ra..ra+n-1 into the cache with one preadv.  Returns
+   the number of whole records read, or -1 on an error */
+
+static int dcfill(dcache_t *dcp, dfile_t *dfp, int ra, int n) {
+  struct iovec iov[DCMAXRA];
+  int i, slot;
+  ssize_t nb;
+
+  for (i=0; i<n; i++) {
+    slot = DCSLOT(ra+i);
+    if (dcp->tag[slot] == ra+i && dcp->dirty[slot])
+      break;                               /* don't clobber newer data */
+    if (dcevict(dcp, dfp, slot) == -1)
+      return -1;
+    iov[i].iov_base = DCDATA(dcp, slot);
+    iov[i].iov_len = DCRECBYTES;
+  }
+  n = i;
+  if (n == 0)
+    return 0;
+  if ((nb = dfrw(dfp, 0, iov, n, (off_t)ra*DCRECBYTES, n*DCRECBYTES)) == -1)
+    return -1;
+  for (i=0; i<nb/DCRECBYTES; i++)
+    dcp->tag[DCSLOT(ra+i)] = ra+i;
+  return i;
+}
+
+/* do a transfer through the unit's cache.  Transfers larger than a
+   record, a partial write of a record that isn't cached, and a read
+   that can't be cached (eg, past the end of the disk file) go
+   straight to the disk file */
+
+static ssize_t dcxfer(dcache_t *dcp, dfile_t *dfp, int write, struct iovec *iov, int niov, off_t offset, int nbytes) {
+  int ra, slot, i, n, nra;
+  unsigned char *p;
+
+  ra = offset/DCRECBYTES;
+  slot = DCSLOT(ra);
+  if (nbytes > DCRECBYTES || offset % DCRECBYTES) {
+    if (dcflush(dcp, dfp) == -1)
+      return -1;
+    for (i=ra; i <= (offset+nbytes-1)/DCRECBYTES; i++)
+      if (dcp->tag[DCSLOT(i)] == i)
+	dcp->tag[DCSLOT(i)] = -1;
+    goto direct;
+  }
+
+  if (write) {
+    if (dcp->tag[slot] != ra) {
+      if (nbytes < DCRECBYTES)
+	goto direct;
+      if (dcevict(dcp, dfp, slot) == -1)
+	return -1;
+      dcp->tag[slot] = ra;
+    }
+    p = DCDATA(dcp, slot);
+    for (i=0; i<niov; i++) {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+    }
+    if (!dcp->dirty[slot]) {
+      dcp->dirty[slot] = 1;
+      dcp->ndirty++;
+    }
+    return nbytes;
+  }
+
+  if (dcp->tag[slot] != ra) {
+    n = 1;
+    if (ra == dcp->nextra) {
+      nra = dcp->cylrecs - ra % dcp->cylrecs;
+      n = (nra < DCMAXRA) ? nra : DCMAXRA;
+    }
+    if (dcfill(dcp, dfp, ra, n) == -1)
+      return -1;
+  }
+  dcp->nextra = ra+1;
+  if (dcp->tag[slot] != ra)
+    goto direct;
+  p = DCDATA(dcp, slot);
+  for (i=0; i<niov; i++) {
+    memcpy(iov[i].iov_base, p, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  return nbytes;
+
+direct:
+  return dfrw(dfp, write, iov, niov, offset, nbytes);
+}
+
+typedef struct {
+  pthread_t thread;
+  int threadok;                            /* true if thread was started */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int state;                               /* DIO_XXX, mutex protected */
+  int device;                              /* controller device address */
+  int unit;                                /* unit the transfer is for */
+  dfile_t *dfile;                          /* unit's drive file */
+  off_t offset;                            /* byte offset in disk file */
+  int op;                                  /* DOP_XXX */
+  dcache_t *dcache;                        /* unit's record cache */
+  int niov;                                /* # of memory spans */
+  int nbytes;                              /* total bytes to transfer */
+  struct iovec iov[DIOMAXIOV];             /* memory spans, in MEM */
+  ssize_t nb;                              /* bytes transferred, or -1 */
+  int err;                                 /* errno when nb == -1 */
+#ifdef DISKSAFE
+  int copy;                                /* DOP_SNAP: overlay copy */
+  struct timeval stamp;                    /* and the snapshot's stamp */
+  int copied;                              /* true if copy was made */
+#endif
+} dio_t;
+
+#ifdef DISKSAFE
+
+/* write back a unit's cache and copy its overlay for a snapshot.  A
+   failed copy isn't fatal: diofinish tells snapcheck, which won't put
+   the snapshot in place */
+
+static int diosnap(dio_t *dp) {
+  if (dcflush(dp->dcache, dp->dfile) == -1)
+    return -1;
+  msync(dp->dfile->ovlmap, (dp->dfile->ovlrecs+7)/8, MS_SYNC);
+  dp->copied = (ovlsave(dp->dfile, dp->copy, &dp->stamp) == 0);
+  if (!dp->copied)
+    perror("Unable to copy disk overlay for snapshot");
+  return 0;
+}
+
+#endif
+
+static void *diothread(void *arg) {
+  dio_t *dp = arg;
+  ssize_t nb;
+  int err;
+
+  pthread_mutex_lock(&dp->mutex);
+  while (1) {
+    while (dp->state != DIO_BUSY)
+      pthread_cond_wait(&dp->cond, &dp->mutex);
+    pthread_mutex_unlock(&dp->mutex);
+    if (dp->op == DOP_FLUSH)
+      nb = dcflush(dp->dcache, dp->dfile);
+#ifdef DISKSAFE
+    else if (dp->op == DOP_SNAP)
+      nb = diosnap(dp);
+#endif
+    else
+      nb = dcxfer(dp->dcache, dp->dfile, dp->op == DOP_WRITE, dp->iov, dp->niov, dp->offset, dp->nbytes);
+    err = errno;
+    pthread_mutex_lock(&dp->mutex);
+    dp->nb = nb;
+    dp->err = err;
+    dp->state = DIO_DONE;
+    devpollasync(dp->device);
+  }
+  return NULL;
+}
+
+static void dioinit(dio_t *dp, int device) {
+  dp->threadok = 0;
+  dp->state = DIO_IDLE;
+  dp->device = device;
+  pthread_mutex_init(&dp->mutex, NULL);
+  pthread_cond_init(&dp->cond, NULL);
+}
+
+/* hand the transfer setup in dp to the controller's thread */
+
+static void diostart(dio_t *dp) {
+  if (!dp->threadok) {
+    if (pthread_create(&dp->thread, NULL, diothread, dp) != 0)
+      fatal("Unable to create disk I/O thread");
+    dp->threadok = 1;
+  }
+  pthread_mutex_lock(&dp->mutex);
+  dp->state = DIO_BUSY;
+  pthread_cond_signal(&dp->cond);
+  pthread_mutex_unlock(&dp->mutex);
+}
+
+/* the thread sets DIO_DONE, so state is only read with the mutex */
+
+static int diostate(dio_t *dp) {
+  int state;
+
+  pthread_mutex_lock(&dp->mutex);
+  state = dp->state;
+  pthread_mutex_unlock(&dp->mutex);
+  return state;
+}
+
+static int diodone(dio_t *dp) {
+  return diostate(dp) == DIO_DONE;
+}
+
+/* add a DMA channel's buffer to the transfer, one iovec per page */
+
+static void diodma(dio_t *dp, unsigned int dmaaddr, int dmanw) {
+  int nw;
+
+  while (dmanw > 0) {
+    if (dp->niov == DIOMAXIOV)
+      fatal("devdisk: too many DMA channels");
+    if (getcrs16(MODALS) & 020) {            /* mapped I/O */
+      nw = 02000 - (dmaaddr & 01777);
+      if (nw > dmanw)
+	nw = dmanw;
+    } else
+      nw = dmanw;
+    dp->iov[dp->niov].iov_base = MEM+mapio(dmaaddr);
+    dp->iov[dp->niov].iov_len = nw*2;
+    dp->niov++;
+    dp->nbytes += nw*2;
+    dmaaddr += nw;
+    dmanw -= nw;
+  }
+}
+
+/* copy a transfer between memory and a buffer holding its records,
+   ie, a mmap'd disk image (-diskmap).  With
+   -diskmap sync, writes to a mapping are msync'd before the channel
+   program continues; otherwise the kernel writes them back */
+
+static void diocopy(dio_t *dp, unsigned char *p, int msyncit) {
+  unsigned char *p0;
+  long pagemask;
+  int i;
+
+  p0 = p;
+  for (i=0; i<dp->niov; i++) {
+    if (dp->op == DOP_WRITE)
+      memcpy(p, dp->iov[i].iov_base, dp->iov[i].iov_len);
+    else
+      memcpy(dp->iov[i].iov_base, p, dp->iov[i].iov_len);
+    p += dp->iov[i].iov_len;
+  }
+  dp->nb = dp->nbytes;
+  if (msyncit && dp->op == DOP_WRITE) {
+    pagemask = sysconf(_SC_PAGESIZE) - 1;
+    if (msync((void *)((unsigned long)p0 & ~pagemask), p - (unsigned char *)((unsigned long)p0 & ~pagemask), MS_SYNC) == -1) {
+      dp->nb = -1;
+      dp->err = errno;
+    }
+  }
+}
+
+/* finish a transfer after the host I/O is done: zero whatever part of
+   a read the disk file couldn't supply.  Returns controller status
+   bits to set */
+
+static int diofinish(dio_t *dp) {
+  int i, nb, len, status;
+  unsigned short *iobufp;
+
+  status = 0;
+  nb = dp->nb;
+  if (dp->op != DOP_READ) {
+    if (nb != dp->nbytes) {
+      errno = dp->err;
+      perror("Unable to write drive file");
+      fatal(NULL);
+    }
+  } else {
+    if (nb != dp->nbytes) {
+      if (nb != 0) fprintf(stderr, "Disk read error: device='%o, u=%d, fd=%d, nb=%d\n", dp->device, dp->unit, dp->dfile->fd, nb);
+      if (nb == -1) {
+	errno = dp->err;
+	perror("Unable to read drive file");
+	status = 010000;                   /* read check */
+	nb = 0;
+      }
+    }
+    for (i=0; i<dp->niov; i++) {
+      iobufp = dp->iov[i].iov_base;
+      len = dp->iov[i].iov_len;
+      if (nb < len)
+	memset((char *)iobufp + nb, 0, len - nb);
+      nb = (nb > len) ? nb - len : 0;
+      pdcinvrange(iobufp-MEM, len/2);
+    }
+  }
+#ifdef DISKSAFE
+  if (dp->op == DOP_SNAP) {
+    snapcopies--;
+    if (!dp->copied)
+      snapcopyfail = 1;
+  }
+#endif
+  pthread_mutex_lock(&dp->mutex);
+  dp->state = DIO_IDLE;
+  pthread_mutex_unlock(&dp->mutex);
+  return status;
+}
+
+
 /* disk controller at '26 and '27
 
   NOTES:
@@ -1707,16 +2441,107 @@ int globdisk (char *devfile, int size, int device, int unit) {
 
  */
 
-int devdisk (int class, int func, int device) {
-
 #include "geom.h"
 
+typedef struct {
+  int rtfd;                              /* read trace file descriptor */
+  short heads;                           /* total heads */
+  short spt;                             /* sectors per track */
+  short maxtrack;                        /* cylinder limit */
+  short curtrack;                        /* current head position */
+  short wp;                              /* true if write protected */
+  int devfd;                             /* Unix device file descriptor */
+  int readnum;                           /* increments on each read */
+  dfile_t dfile;                         /* drive file (+ overlay) */
+  dcache_t dcache;                       /* record cache */
+  unsigned char *map;                    /* mmap'd disk file (-diskmap) */
+  off_t mapsize;                         /* bytes mapped */
+} dunit_t;
+
+/* open a drive's file the first time it's selected (or when a
+   snapshot is restored).  Returns 0 if the drive is ready, -1 if
+   there is no drive file, -2 if it can't be used */
+
+static int diskopen(dunit_t *up, int device, int u) {
+  int i;
+  int lockkey;
+  int shared;
+  struct stat st;
+  void *mapp;
+  char devfile[MAXPATHLEN];
+
+  if (up->devfd == -2 || globdisk(devfile, sizeof(devfile), device, u) != 0) {
+    up->devfd = -2;
+    return -1;
+  }
+
+  /* drive files from -diskbase are shared with other emulators, so
+     they're only opened for reading (and overlays can't be committed
+     to them) */
+
+  shared = 0;
+#ifdef DISKSAFE
+  if (diskbase != NULL && strncmp(devfile, diskbase, strlen(diskbase)) == 0 && devfile[strlen(diskbase)] == '/')
+    shared = 1;
+#endif
+  if (shared || (up->devfd = open(devfile, O_RDWR)) == -1) {
+    if ((up->devfd = open(devfile, O_RDONLY)) == -1) {
+      fprintf(stderr, "em: unable to open disk device file %s for device '%o unit %d\n", devfile, device, u);
+      up->devfd = -2;
+      return -2;
+    } else {
+      lockkey = LOCK_SH;
+      up->wp = 1;
+    }
+  } else {
+    lockkey = LOCK_EX;
+    up->wp = 0;
+  }
+  /* determine geometry from disk file suffix */
+  for (i=0; i < NUMGEOM; i++)
+    if (strcasestr(devfile, geom[i].suffix)) {
+      up->heads = geom[i].heads;
+      up->spt = geom[i].spt;
+      up->maxtrack = geom[i].maxtrack;
+      break;
+    }
+  if (i == NUMGEOM) {
+    fprintf(stderr, "em: unknown geometry for %s\n", devfile);
+    close(up->devfd);
+    up->devfd = -2;
+    return -2;
+  }
+  dcinit(&up->dcache, up->heads*up->spt);
+  up->dfile.fd = up->devfd;
+#ifndef DISKSAFE                          /* the overlay can't be mapped */
+  if (diskmap && fstat(up->devfd, &st) == 0 && st.st_size > 0) {
+    mapp = mmap(NULL, st.st_size, PROT_READ | (up->wp ? 0 : PROT_WRITE), MAP_SHARED, up->devfd, 0);
+    if (mapp == MAP_FAILED)
+      perror("em: unable to mmap disk file; using read/write");
+    else {
+      madvise(mapp, st.st_size, diskmapadvice);
+      up->map = mapp;
+      up->mapsize = st.st_size;
+    }
+  }
+#endif
+#ifdef DISKSAFE
+  if (flock(up->devfd, LOCK_SH+LOCK_NB) == -1)
+    fatal("Disk drive file is in use");
+  ovlopen(&up->dfile, devfile, (up->maxtrack+2)*up->heads*up->spt + 256, up->wp);
+#else
+  if (flock(up->devfd, lockkey+LOCK_NB) == -1)
+    fatal("Disk drive file is in use");
+#endif
+  return 0;
+}
+
+int devdisk (int class, int func, int device) {
+
 #define S_HALT 0
 #define S_RUN 1
 #define S_INT 2
 
-#define HASHMAX 4451
-
 #if 1
   #define CID4005 0100
 #else
@@ -1732,17 +2557,14 @@ int devdisk (int class, int func, int device) {
     short usel;                            /* unit selected (0-3, -1=none) */
     short dmachan;                         /* dma channel selected */
     short dmanch;                          /* number of dma channels-1 */
-    struct {
-      int rtfd;                            /* read trace file descriptor */
-      short heads;                         /* total heads */
-      short spt;                           /* sectors per track */
-      short maxtrack;                      /* cylinder limit */
-      short curtrack;                      /* current head position */
-      short wp;                            /* true if write protected */
-      int devfd;                           /* Unix device file descriptor */
-      int readnum;                         /* increments on each read */
-      unsigned char** modrecs;             /* hash table of modified records */
-    } unit[MAXDRIVES];
+    dunit_t unit[MAXDRIVES];
+    dio_t dio;                             /* host I/O thread state */
+    unsigned int flushic;                  /* instcount records went dirty */
+#ifdef DISKSAFE
+    int snapunits;                         /* units left to copy (bits) */
+    int snapcopy;                          /* overlay copy to make */
+    struct timeval snapstamp;              /* and its stamp */
+#endif
   } dc[MAXCTRL];
 
   short i,u;
@@ -1755,16 +2577,16 @@ int devdisk (int class, int func, int device) {
   short head, track, rec, recsize;
   unsigned short dmareg;
   unsigned int dmaaddr;
-  unsigned char *hashp;
-  int lockkey;
 
-  unsigned short iobuf[1040];             /* local I/O buf (for mapped I/O) */
   unsigned short *iobufp;
+  dio_t *dp;
   short dmanw;
   char ordertext[8];
   int phyra;
   int nb;                   /* number of bytes returned from read/write */
-  char devfile[16];
+  int ndirty;
+  unsigned int dirtyic;
+  dfid_t id, curid;         /* drive file identities */
 
   /* map device id to device context index
 
@@ -1793,7 +2615,7 @@ int devdisk (int class, int func, int device) {
 
   case -1:
 #ifdef DISKSAFE
-    printf("em: Running in DISKSAFE mode; no changes will be permanent\n");
+    printf("em: Running in DISKSAFE mode; changes go to ovl-* overlay files\n");
 #endif
     dc[dx].device = device;
     dc[dx].state = S_HALT;
@@ -1808,7 +2630,134 @@ int devdisk (int class, int func, int device) {
       dc[dx].unit[u].wp = -1;
       dc[dx].unit[u].devfd = -1;
       dc[dx].unit[u].readnum = -1;
-      dc[dx].unit[u].modrecs = NULL;
+      dc[dx].unit[u].dcache.data = NULL;
+      dc[dx].unit[u].dcache.ndirty = 0;
+      dc[dx].unit[u].map = NULL;
+    }
+    dioinit(&dc[dx].dio, device);
+    dc[dx].flushic = 0;
+#ifdef DISKSAFE
+    dc[dx].snapunits = 0;
+#endif
+    return 0;
+
+  case -2:
+
+    /* wait for the I/O thread, then write back cached records */
+
+    dp = &dc[dx].dio;
+    while (diostate(dp) == DIO_BUSY)
+      usleep(1000);
+    for (u=0; u<MAXDRIVES; u++) {
+      if (dcflush(&dc[dx].unit[u].dcache, &dc[dx].unit[u].dfile) == -1)
+	perror("Unable to write drive file");
+#ifdef DISKSAFE
+      if (dc[dx].unit[u].devfd >= 0)
+	msync(dc[dx].unit[u].dfile.ovlmap, (dc[dx].unit[u].dfile.ovlrecs+7)/8, MS_SYNC);
+      if ((dc[dx].snapunits & (1 << u)) && ovlsave(&dc[dx].unit[u].dfile, dc[dx].snapcopy, &dc[dx].snapstamp) == -1)
+	perror("Unable to copy disk overlay for snapshot");
+#endif
+      if (dc[dx].unit[u].map != NULL) {
+	if (msync(dc[dx].unit[u].map, dc[dx].unit[u].mapsize, MS_SYNC) == -1)
+	  perror("Unable to msync drive file");
+	munmap(dc[dx].unit[u].map, dc[dx].unit[u].mapsize);
+	dc[dx].unit[u].map = NULL;
+      }
+    }
+    return 0;
+
+  case -3:
+
+#ifdef DISKSAFE
+
+    /* reap a transfer in progress, so memory is in the snapshot as
+       the channel program left it (it picks up after the transfer at
+       the next poll).  The drive files aren't written, so only the
+       overlays need to be saved: each open unit's cache is written
+       back and its overlay copied by the I/O thread, one unit at a
+       time, before the channel program runs again */
+
+    dp = &dc[dx].dio;
+    if (diostate(dp) != DIO_IDLE && (dp->op == DOP_READ || dp->op == DOP_WRITE)) {
+      while (!diodone(dp))
+	usleep(1000);
+      dc[dx].status |= diofinish(dp);
+    }
+    dc[dx].snapcopy = (snapslot < 0) ? OVLSNAP : snapslot;
+    gettimeofday(&dc[dx].snapstamp, NULL);
+    dc[dx].snapunits = 0;
+    for (u=0; u<MAXDRIVES; u++)
+      if (dc[dx].unit[u].devfd >= 0) {
+	dc[dx].snapunits |= 1 << u;
+	snapcopies++;
+      }
+    if (dc[dx].snapunits)
+      setdevpoll(device, 1);
+#else
+
+    /* reap any transfer in progress (the channel program picks up
+       after it at the next poll) and write back the caches, so the
+       drive files match the snapshot and their modification times
+       can be saved.  Without DISKSAFE there are no checkpoints, so
+       this only happens for a -snapshot */
+
+    dp = &dc[dx].dio;
+    while (diostate(dp) == DIO_BUSY)
+      usleep(1000);
+    if (diodone(dp))
+      dc[dx].status |= diofinish(dp);
+    for (u=0; u<MAXDRIVES; u++) {
+      if (dcflush(&dc[dx].unit[u].dcache, &dc[dx].unit[u].dfile) == -1) {
+	perror("Unable to write drive file");
+	fatal(NULL);
+      }
+      if (dc[dx].unit[u].map != NULL)
+	msync(dc[dx].unit[u].map, dc[dx].unit[u].mapsize, MS_SYNC);
+    }
+    dc[dx].flushic = 0;
+#endif
+
+    /* fall through */
+
+  case -4:
+
+    /* on restore, drives that were open are opened again, and must
+       be the same files, unchanged since the snapshot.  Their
+       overlays are put back from the snapshot's copies */
+
+    SNAPVAR(class, dc[dx].oar);
+    SNAPVAR(class, dc[dx].state);
+    SNAPVAR(class, dc[dx].status);
+    SNAPVAR(class, dc[dx].usel);
+    SNAPVAR(class, dc[dx].dmachan);
+    SNAPVAR(class, dc[dx].dmanch);
+    for (u=0; u<MAXDRIVES; u++) {
+      SNAPVAR(class, dc[dx].unit[u].curtrack);
+      i = (dc[dx].unit[u].devfd >= 0);
+      SNAPVAR(class, i);
+      if (!i)
+	continue;
+      if (class == -3)
+	dfident(dc[dx].unit[u].devfd, &id);
+      SNAPVAR(class, id);
+#ifdef DISKSAFE
+      SNAPVAR(class, dc[dx].snapcopy);
+      SNAPVAR(class, dc[dx].snapstamp);
+#endif
+      if (class == -4) {
+	if (dc[dx].unit[u].devfd < 0 && diskopen(&dc[dx].unit[u], device, u) != 0) {
+	  fprintf(stderr, "em: drive file for device '%o unit %d is missing\n", device, u);
+	  fatal("Unable to restore snapshot");
+	}
+	dfident(dc[dx].unit[u].devfd, &curid);
+	if (memcmp(&id, &curid, sizeof(id)) != 0) {
+	  fprintf(stderr, "em: drive file for device '%o unit %d has changed since the snapshot\n", device, u);
+	  fatal("Unable to restore snapshot");
+	}
+#ifdef DISKSAFE
+	ovlrestore(&dc[dx].unit[u].dfile, dc[dx].snapcopy, &dc[dx].snapstamp);
+#endif
+      }
     }
     return 0;
       
@@ -1817,7 +2766,7 @@ int devdisk (int class, int func, int device) {
     if (func == 016) {                /* reset interrupt */
       if (dc[dx].state == S_INT) {
 	dc[dx].state = S_RUN;
-	devpoll[device] = 1;
+	setdevpoll(device, 1);
       }
     } else if (func == 017) {         /* reset controller */
       dc[dx].state = S_HALT;
@@ -1869,7 +2818,7 @@ int devdisk (int class, int func, int device) {
     if (func == 017) {        /* set OAR (order address register) */
       dc[dx].state = S_RUN;
       dc[dx].oar = getcrs16(A);
-      devpoll[device] = 1;
+      setdevpoll(device, 1);
     } else {
       printf("Unimplemented OTA device '%02o function '%02o, A='%o\n", device, func, getcrs16(A));
       fatal(NULL);
@@ -1879,6 +2828,41 @@ int devdisk (int class, int func, int device) {
 
   case 4:   /* poll (run channel program) */
 
+    /* if a host transfer is outstanding, the channel program is
+       stalled on it: wait for the I/O thread, then reap it */
+
+    dp = &dc[dx].dio;
+    if (diostate(dp) != DIO_IDLE) {
+      if (!diodone(dp)) {
+	setdevpoll(device, gv.instpermsec/10);
+	return 0;
+      }
+      dc[dx].status |= diofinish(dp);
+    }
+
+#ifdef DISKSAFE
+
+    /* a snapshot's overlay copies go before any more transfers */
+
+    if (dc[dx].snapunits) {
+      for (u=0; !(dc[dx].snapunits & (1 << u)); u++)
+	;
+      dc[dx].snapunits &= ~(1 << u);
+      TRACE(T_INST|T_DIO, " copy overlay of unit %d for snapshot\n", u);
+      dp->unit = u;
+      dp->dfile = &dc[dx].unit[u].dfile;
+      dp->op = DOP_SNAP;
+      dp->dcache = &dc[dx].unit[u].dcache;
+      dp->niov = 0;
+      dp->nbytes = 0;
+      dp->copy = dc[dx].snapcopy;
+      dp->stamp = dc[dx].snapstamp;
+      diostart(dp);
+      setdevpoll(device, gv.instpermsec/10);
+      return 0;
+    }
+#endif
+
     while (dc[dx].state == S_RUN) {
       m = get16io(dc[dx].oar);
       m1 = get16io(dc[dx].oar+1);
@@ -1898,7 +2882,7 @@ int devdisk (int class, int func, int device) {
 
       case 0: /* DHLT = Halt */
 	dc[dx].state = S_HALT;
-	devpoll[device] = 0;
+	setdevpoll(device, 0);
 	TRACE(T_INST|T_DIO, " channel halted at '%o\n", dc[dx].oar);
 	break;
 
@@ -1965,43 +2949,15 @@ int devdisk (int class, int func, int device) {
 	  TRACE(T_INST|T_DIO,  " Unix ra=%d, byte offset=%d\n", phyra, phyra*2080);
 	  /* XXX: check for phyra > 1032444, which is > 2GB max file size */
 
-	  /* does this record exist in the disk unit hash table?  If it does,
-	     we'll do I/O to the hash entry.  If it doesn't, then for read,
-	     go to the disk file; for write, make a new hash entry */
-
-	  hashp = NULL;
-
-#ifdef DISKSAFE
-	  //fprintf(stderr," R/W, modrecs=%p\n", dc[dx].unit[u].modrecs);
-	  for (hashp = dc[dx].unit[u].modrecs[phyra%HASHMAX]; hashp != NULL; hashp = *((unsigned char **)hashp)) {
-	    //fprintf(stderr," lookup, hashp=%p\n", hashp);
-	    if (phyra == *((int *)(hashp+sizeof(void *))))
-	      break;
-	  }
-	  //fprintf(stderr,"After search, hashp=%p\n", hashp);
-
-	  if (hashp == NULL)
-	    if (order == 5) {        /* read */
-#endif
-	      if (lseek(dc[dx].unit[u].devfd, phyra*2080, SEEK_SET) == -1) {
-		fprintf(stderr,"devdisk: seek error, phyra=%d\n", phyra);
-		perror("Unable to seek drive file");
-		fatal(NULL);
-	      }
-#ifdef DISKSAFE
-	    } else {                 /* write */
-	      hashp = malloc(1040*2 + sizeof(void*) + sizeof(int));
-	      *(unsigned char **)hashp = dc[dx].unit[u].modrecs[phyra%HASHMAX];
-	      *((int *)(hashp+sizeof(void *))) = phyra;
-	      //fprintf(stderr," Write, new hashp = %p, old bucket head = %p\n", hashp, *(unsigned char **)hashp);
-	      dc[dx].unit[u].modrecs[phyra%HASHMAX] = hashp;
-	      hashp = hashp + sizeof(void*) + sizeof(int);
-	    }
-	  else
-	    hashp = hashp + sizeof(void*) + sizeof(int);
-	  //fprintf(stderr," Before disk op %d, hashp=%p\n", order, hashp);
-#endif
+	  /* collect the DMA channels into the dio_t */
 
+	  dp->unit = u;
+	  dp->dfile = &dc[dx].unit[u].dfile;
+	  dp->offset = (off_t)phyra*2080;
+	  dp->op = (order == 6) ? DOP_WRITE : DOP_READ;
+	  dp->dcache = &dc[dx].unit[u].dcache;
+	  dp->niov = 0;
+	  dp->nbytes = 0;
 	  while (dc[dx].dmanch >= 0) {
 	    dmareg = dc[dx].dmachan << 1;
 	    dmanw = getar16(REGDMX16+dmareg);
@@ -2015,50 +2971,29 @@ int devdisk (int class, int func, int device) {
 	      dmanw = 0;
 	    }
 	    dmaaddr = ((getar16(REGDMX16+dmareg) & 3)<<16) | getar16(REGDMX16+dmareg+1);
-	    TRACE(T_INST|T_DIO,  " DMA channels: nch-1=%d, ['%o]='%o, ['%o]='%o, nwords=%d\n", dc[dx].dmanch, dc[dx].dmachan, swap16(regs.sym.regdmx[dmareg]), dc[dx].dmachan+1, dmaaddr, dmanw);
-	    
-	    if (order == 5) {    /* read */
-	      if (getcrs16(MODALS) & 020)  /* mapped read */
-		if ((dmaaddr & 01777) || dmanw > 1024)
-		  iobufp = iobuf;
-		else
-		  iobufp = MEM+mapio(dmaaddr);
-	      else                         /* physical read */
-		iobufp = MEM+dmaaddr;
-	      if (hashp != NULL) {
-		memcpy((char *)iobufp, hashp, dmanw*2);
-		hashp += dmanw*2;
-	      } else if ((nb=read(dc[dx].unit[u].devfd, (char *)iobufp, dmanw*2)) != dmanw*2) {
-		if (nb != 0) fprintf(stderr, "Disk read error: device='%o, u=%d, fd=%d, nb=%d\n", device, u, dc[dx].unit[u].devfd, nb);
-		if (nb == -1) {
-		  perror("Unable to read drive file");
-		  dc[dx].status |= 010000;  /* read check */
-		}
-		memset((char *)iobufp, 0, dmanw*2);
-	      }
-	      if (iobufp == iobuf)
-		for (i=0; i<dmanw; i++)
-		  MEM[mapio(dmaaddr+i)] = iobuf[i];  /* Prime->Prime: no swap */
-	    } else {         /* disk write */
-	      if (getcrs16(MODALS) & 020) {  /* mapped write */
-		iobufp = iobuf;
-		for (i=0; i<dmanw; i++)
-		  iobuf[i] = MEM[mapio(dmaaddr+i)];  /* Prime->Prime: no swap */
-	      } else
-		iobufp = MEM+dmaaddr;
-	      if (hashp != NULL) {
-		memcpy(hashp, (char *)iobufp, dmanw*2);
-		hashp += dmanw*2;
-	      } else if (write(dc[dx].unit[u].devfd, (char *)iobufp, dmanw*2) != dmanw*2) {
-		perror("Unable to write drive file");
-		fatal(NULL);
-	      }
-	    }
-	    regs.sym.regdmx[dmareg] = 0;
+	    TRACE(T_INST|T_DIO,  " DMA channels: nch-1=%d, ['%o]='%o, ['%o]='%o, nwords=%d\n", dc[dx].dmanch, dc[dx].dmachan, getar16(REGDMX16+dmareg), dc[dx].dmachan+1, dmaaddr, dmanw);
+	    diodma(dp, dmaaddr, dmanw);
+	    putar16(REGDMX16+dmareg, 0);
 	    putar16(REGDMX16+dmareg+1, getar16(REGDMX16+dmareg+1) + dmanw);
 	    dc[dx].dmachan += 2;
 	    dc[dx].dmanch--;
 	  }
+
+	  /* records inside a mmap'd disk image are copied here;
+	     everything else goes to the I/O thread, and the channel
+	     program continues after the transfer is reaped.
+	     Transfers past the end of a mapping (the image grows as
+	     records are written) go through the thread, so a record
+	     is always either in the mapping or the cache */
+
+	  if (dc[dx].unit[u].map != NULL && dp->offset + dp->nbytes <= dc[dx].unit[u].mapsize && !(order == 6 && dc[dx].unit[u].wp)) {
+	    diocopy(dp, dc[dx].unit[u].map + dp->offset, diskmapsync);
+	    dc[dx].status |= diofinish(dp);
+	  } else {
+	    diostart(dp);
+	    setdevpoll(device, gv.instpermsec/10);
+	    return 0;
+	  }
 	}
 	break;
 
@@ -2113,49 +3048,14 @@ int devdisk (int class, int func, int device) {
 	}
 	TRACE(T_INST|T_DIO, " select unit %d\n", u);
 	if (dc[dx].unit[u].devfd < 0) {
-	  if (dc[dx].unit[u].devfd == -2 || globdisk(devfile, sizeof(devfile), device, u) != 0) {
-	    dc[dx].unit[u].devfd = -2;
+	  i = diskopen(&dc[dx].unit[u], device, u);
+	  if (i == -1) {
 	    dc[dx].status |= 0100001;  /* set bit 16: not ready */
 	    break;
-	  }
-	  if ((dc[dx].unit[u].devfd = open(devfile, O_RDWR)) == -1) {
-	    if ((dc[dx].unit[u].devfd = open(devfile, O_RDONLY)) == -1) {
-	      fprintf(stderr, "em: unable to open disk device file %s for device '%o unit %d\n", devfile, device, u);
-	      dc[dx].unit[u].devfd = -2;
-	      dc[dx].status = 0100001;    /* not ready */
-	      break;
-	    } else {
-	      lockkey = LOCK_SH;
-	      dc[dx].unit[u].wp = 1;
-	    }
-	  } else {
-	    lockkey = LOCK_EX;
-	    dc[dx].unit[u].wp = 0;
-	  }
-	  /* determine geometry from disk file suffix */
-	  for (i=0; i < NUMGEOM; i++)
-	    if (strcasestr(devfile, geom[i].suffix)) {
-	      dc[dx].unit[u].heads = geom[i].heads;
-	      dc[dx].unit[u].spt = geom[i].spt;
-	      dc[dx].unit[u].maxtrack = geom[i].maxtrack;
-	      break;
-	    }
-	  if (i == NUMGEOM) {
-	    fprintf(stderr, "em: unknown geometry for %s\n", devfile);
-	    close(dc[dx].unit[u].devfd);
-	    dc[dx].unit[u].devfd = -2;
+	  } else if (i == -2) {
 	    dc[dx].status = 0100001;    /* not ready */
 	    break;
 	  }
-#ifdef DISKSAFE
-	  if (flock(dc[dx].unit[u].devfd, LOCK_SH+LOCK_NB) == -1)
-	    fatal("Disk drive file is in use");
-	  dc[dx].unit[u].modrecs = calloc(HASHMAX, sizeof(void *));
-	  //fprintf(stderr," Device '%o, unit %d, modrecs=%p\n", device, u, dc[dx].unit[u].modrecs);
-#else
-	  if (flock(dc[dx].unit[u].devfd, lockkey+LOCK_NB) == -1)
-	    fatal("Disk drive file is in use");
-#endif
 	}
 	dc[dx].usel = u;
 	break;
@@ -2173,7 +3073,7 @@ int devdisk (int class, int func, int device) {
 
 	if (getcrs16(MODALS) & 010)             /* PX enabled? */
 	  break;                           /* yes, no stall */
-	devpoll[device] = gv.instpermsec/5;   /* 200 microseconds, sb 210 */
+	setdevpoll(device, gv.instpermsec/5); /* 200 microseconds, sb 210 */
 	return;
 
       case 9: /* DSTAT = Store status to memory */
@@ -2201,7 +3101,7 @@ int devdisk (int class, int func, int device) {
 	  dc[dx].state = S_INT;
 	}
 	//gv.traceflags = ~T_MAP;
-	devpoll[device] = 10;
+	setdevpoll(device, 10);
 	return;
 
       case 15: /* DTRAN = channel program jump */
@@ -2217,6 +3117,40 @@ int devdisk (int class, int func, int device) {
 	fatal(NULL);
       }
     }
+
+    /* once the channel program halts, hand a cache flush to the I/O
+       thread if there's a batch of dirty records or they've waited
+       DCFLUSHMS; otherwise, come back when they will have.  The poll
+       that reaps a flush gets here again to start the next unit */
+
+    if (dc[dx].state == S_HALT && diostate(dp) == DIO_IDLE) {
+      ndirty = 0;
+      for (u=0; u<MAXDRIVES; u++)
+	ndirty += dc[dx].unit[u].dcache.ndirty;
+      if (ndirty == 0) {
+	dc[dx].flushic = 0;
+	break;
+      }
+      if (dc[dx].flushic == 0)
+	dc[dx].flushic = gv.instcount | 1;
+      dirtyic = gv.instcount - dc[dx].flushic;
+      if (ndirty < DCBATCH && dirtyic < DCFLUSHMS*gv.instpermsec) {
+	setdevpoll(device, DCFLUSHMS*gv.instpermsec - dirtyic);
+	break;
+      }
+      for (u=0; dc[dx].unit[u].dcache.ndirty == 0; u++)
+	;
+      TRACE(T_INST|T_DIO, " flush %d records of unit %d\n", dc[dx].unit[u].dcache.ndirty, u);
+      dp->unit = u;
+      dp->dfile = &dc[dx].unit[u].dfile;
+      dp->op = DOP_FLUSH;
+      dp->dcache = &dc[dx].unit[u].dcache;
+      dp->niov = 0;
+      dp->nbytes = 0;
+      diostart(dp);
+      setdevpoll(device, gv.instpermsec/10);
+    }
+    break;
   }
 }
 
@@ -117,11 +117,28 @@ int prieee8(unsigned long long dp, double *d) {
   return 1;
 }
 
+/* host-double shadows of FAC0 and FAC1.  Each one holds a Prime
+   DPFP value and its exact IEEE equivalent, so it stays correct no
+   matter what happens to the FAC: loads, live register stores,
+   register set switches, etc. just leave FAC bits that don't match
+   the shadow and the next operation converts with prieee8 again.
+   Chains of FP operations find their previous result in the shadow
+   and skip the Prime->IEEE conversion. */
+
+typedef struct {
+  unsigned long long bits;      /* Prime DPFP, as returned by getfr64 */
+  double d;                     /* exact IEEE value of bits */
+} facsh_t;
+
+static facsh_t facsh[2];        /* [0] = FAC0, [1] = FAC1 */
+
 /* conversion from IEEE back to Prime.  Prime exponents are larger, so
    this conversion cannot overflow/underflow, but precision may be
-   lost */
+   lost.  p points to a 64-bit register (FAC0/FAC1) and the result
+   is stored in register file order.  If sh isn't null, it's updated
+   with the result when that fits comfortably in an IEEE double */
 
-int ieeepr8(double d, long long *p, int round) {
+int ieeepr8(double d, long long *p, int round, facsh_t *sh) {
   long long frac64;
   int exp32, neg, okay;
 
@@ -162,6 +179,10 @@ retry:
     frac64 |= 0x10000000000000LL;
   else if (frac64 == 0) {   /* IEEE +-0.0 (zero exp+frac) */
     *p = 0;                 /* IEEE and Prime zero are the same */
+    if (sh) {
+      sh->bits = 0;
+      sh->d = 0.0;
+    }
     return okay;
   } else
       ;                     /* subnormal: no hidden 1 bit */
@@ -207,10 +228,44 @@ retry:
       /* XXX: should this be a subtract for negative numbers? */
       frac64 += 0x10000;
 
-  *p = swap64((frac64 & 0xffffffffffff0000LL) | (exp32 & 0xffff));
+  frac64 &= 0xffffffffffff0000LL;
+  *p = RF64(frac64 | (exp32 & 0xffff));
+
+  /* the value is frac64 * 2**(exp32-128-63); the 48-bit fraction
+     converts exactly and the power of 2 is applied in two halves so
+     neither factor is subnormal.  The exponent range leaves a margin
+     so the shadow is always a normal IEEE double */
+
+  if (sh && -890 <= exp32 && exp32 <= 1150) {
+    long long e1, e2;
+    e1 = (exp32-191) >> 1;
+    e2 = (exp32-191) - e1;
+    e1 = (e1+1023) << 52;
+    e2 = (e2+1023) << 52;
+    sh->bits = frac64 | (exp32 & 0xffff);
+    sh->d = (double)frac64 * *(double *)&e1 * *(double *)&e2;
+  }
   return okay;
 }
 
+/* fetch FAC0 (dr=0) or FAC1 (dr=2) as an IEEE double, using the
+   shadow if it still matches the register */
+
+static inline int facget(int dr, double *d) {
+  unsigned long long fac;
+
+  fac = getfr64(dr);
+  if (fac == facsh[dr>>1].bits) {
+    *d = facsh[dr>>1].d;
+    return 1;
+  }
+  return prieee8(fac, d);
+}
+
+/* store an IEEE result into FAC0 (dr=0) or FAC1 (dr=2) */
+
+#define facput(d, dr, round) ieeepr8((d), (long long *)(crsl+FAC0+(dr)), (round), &facsh[(dr)>>1])
+
 
 /* 32-bit signed integer to Prime DPFP conversion */
 
@@ -213,6 +213,28 @@ static short regsets[] = { \
 			   4,  /* 43  P5320 */
 			   4}; /* 44  P5340 */
 
+/* The register file is kept in host byte order as an array of 32-bit
+   words, so most register accesses need no byte swapping.  Prime
+   addresses the file both as 32-bit and 16-bit words, with the left
+   (high) halfword at the even 16-bit address.  On a little-endian
+   host, the high halfword of a 32-bit word is stored second, so
+   16-bit offsets are converted with RF16, which flips the low bit.
+   Likewise, 64-bit registers (FAC0/FAC1, L/E) are two 32-bit words,
+   high word first, so a 64-bit load or store on a little-endian host
+   has to exchange the two halves with RF64.
+
+   Every 16-bit access must go through the accessors below or RF16;
+   the symbolic 16-bit fields in "sym" are declared in the order that
+   makes them line up with their Prime addresses. */
+
+#ifdef __LITTLE_ENDIAN__
+#define RF16(offset) ((offset) ^ 1)
+#define RF64(val) (((uint64_t)(val) << 32) | ((uint64_t)(val) >> 32))
+#else
+#define RF16(offset) (offset)
+#define RF64(val) (val)
+#endif
+
 static union {
     int rs[REGSETS][32];
 
@@ -234,6 +256,15 @@ static union {
     struct {
       unsigned int tr0,tr1,tr2,tr3,tr4,tr5,tr6,tr7;     /*  '0-7  */
       unsigned int rdmx1,rdmx2;                         /* '10-11 */
+#ifdef __LITTLE_ENDIAN__
+      unsigned short ratmpl,rdum1[1];                   /* '12    */
+      unsigned int rsgt1,rsgt2,recc1,recc2;             /* '13-16 */
+      unsigned short reoiv,rdum2[1],one,zero;           /* '17-20 */
+      unsigned int pbsave,rdmx3,rdmx4,c377,rdum3[3];    /* '21-27 */
+      unsigned int pswpb;                               /* '30    */
+      unsigned short rdum4[1],pswkeys;                  /* '31    */
+      unsigned short pcba,pla,pcbb,plb;                 /* '32-33 */
+#else
       unsigned short rdum1[1],ratmpl;                   /* '12    */
       unsigned int rsgt1,rsgt2,recc1,recc2;             /* '13-16 */
       unsigned short rdum2[1],reoiv,zero,one;           /* '17-20 */
@@ -241,10 +272,11 @@ static union {
       unsigned int pswpb;                               /* '30    */
       unsigned short pswkeys,rdum4[1];                  /* '31    */
       unsigned short pla,pcba,plb,pcbb;                 /* '32-33 */
+#endif
       unsigned int dswrma;                              /* '34    */
       unsigned int dswstat;                             /* '35    */
       unsigned int dswpb,rsavptr;                       /* '36-37 */
-      unsigned short regdmx[64];                        /* '40-77 */
+      unsigned short regdmx[64];                        /* '40-77, use RF16 */
       unsigned int userregs[REGSETS-2][32];             /* '100-  */
     } sym;
   } regs;
@@ -286,13 +318,13 @@ static union {
 /* fetch 16-bit unsigned at 16-bit offset */
 //#define getcrs16(offset) crs[(offset)]
 static inline uint16_t getcrs16(int offset) {  \
-  return swap16(crs[offset]);  \
+  return crs[RF16(offset)];  \
 }
 
 /* store 16-bit unsigned at 16-bit offset */
 //#define putcrs16(offset, val) crs[(offset)] = (val)
 static inline void putcrs16(int offset, uint16_t val) {  \
-  crs[(offset)] = swap16(val); \
+  crs[RF16(offset)] = val; \
 }
 
 /* get 16-bit signed at 16-bit offset */
@@ -302,7 +334,7 @@ static inline void putcrs16(int offset, uint16_t val) {  \
 /* get 32-bit unsigned at 16-bit offset */
 //#define getcrs32(offset) *(unsigned int *)(crs+offset)
 static inline uint32_t getcrs32(int offset) {  \
-  return swap32(*(unsigned int *)(crs+offset));  \
+  return *(unsigned int *)(crs+offset);  \
 }
 
 /* get 32-bit signed at 16-bit offset */
@@ -312,7 +344,7 @@ static inline uint32_t getcrs32(int offset) {  \
 /* put 32-bit unsigned at 16-bit offset */
 //#define putcrs32(offset, val) *(unsigned int *)(crs+(offset)) = (val)
 static inline void putcrs32(int offset, uint32_t val) {  \
-  *(unsigned int *)(crs+offset) = swap32(val);  \
+  *(unsigned int *)(crs+offset) = val;  \
 }
 
 /* put 32-bit signed at 16-bit offset */
@@ -330,29 +362,29 @@ static inline void putcrs32(int offset, uint32_t val) {  \
 /* get 64-bit signed at 16-bit offset */
 //#define getcrs64s(offset) *(long long *)(crs+(offset))
 static inline int64_t getcrs64s(int offset) {  \
-  return (long long)swap64(*(long long *)(crs+(offset)));	\
+  return (long long)RF64(*(long long *)(crs+(offset)));	\
 }
 
 /* put 64-bit signed at 16-bit offset */
 //#define putcrs64s(offset, val) *(long long *)(crs+(offset)) = (val)
 static inline void putcrs64s(int offset, int64_t val) {  \
-  *(long long *)(crs+offset) = swap64(val);  \
+  *(long long *)(crs+offset) = RF64(val);  \
 }
 
 /* put 64-bit double at 16-bit offset (remove later) */
 //#define putcrs64d(offset, val) *(double *)(crs+(offset)) = (val)
 static inline void putcrs64d(int offset, double val) {  \
-  *(unsigned long long *)(crs+offset) = swap64(*(uint64_t *)&val);	  \
+  *(unsigned long long *)(crs+offset) = RF64(*(uint64_t *)&val);	  \
 }
 
 /* get 16-bit unsigned at 16-bit absolute register file address */
 static inline uint16_t getar16(int offset) {  \
-  return swap16(regs.u16[offset]);  \
+  return regs.u16[RF16(offset)];  \
 }
 
 /* put 16-bit unsigned at 16-bit absolute register file address */
 static inline void putar16(int offset, uint16_t val) {  \
-  regs.u16[(offset)] = swap16(val); \
+  regs.u16[RF16(offset)] = val; \
 }
 
 /******* 32-bit offset macros: ***********/
@@ -360,13 +392,13 @@ static inline void putar16(int offset, uint16_t val) {  \
 /* fetch 16-bit unsigned at 32-bit offset (left halfword is returned) */
 //#define getgr16(offset) crs[(offset)*2]
 static inline uint16_t getgr16(int offset) {  \
-  return swap16(crs[offset*2]); \
+  return crs[RF16(offset*2)]; \
 }
 
 /* store 16-bit unsigned at 32-bit offset (in left halfword) */
 //#define putgr16(offset, val) crs[(offset)*2] = (val)
 static inline void putgr16(int offset, uint16_t val) {  \
-  crs[(offset)*2] = swap16(val); \
+  crs[RF16((offset)*2)] = val; \
 }
 
 /* fetch 16-bit signed at 32-bit offset (right halfword is returned) */
@@ -380,13 +412,13 @@ static inline void putgr16(int offset, uint16_t val) {  \
 /* fetch 32-bit unsigned at 32-bit offset */
 //#define getgr32(offset) crsl[(offset)]
 static inline uint32_t getgr32(int offset) {  \
-  return swap32(crsl[offset]);
+  return crsl[offset];
 }
 
 /* store 32-bit unsigned at 32-bit offset */
 //#define putgr32(offset, val) crsl[(offset)] = (val)
 static inline void putgr32(int offset, uint32_t val) {  \
-  crsl[offset] = swap32(val); \
+  crsl[offset] = val; \
 }
 
 /* fetch 32-bit signed at 32-bit offset */
@@ -400,13 +432,13 @@ static inline void putgr32(int offset, uint32_t val) {  \
 /* fetch 64-bit signed at 32-bit offset */
 //#define getgr64s(offset) *(long long *)(crsl+(offset))
 static inline int64_t getgr64s(int offset) {  \
-  return (int64_t) swap64(*(long long *)(crsl+offset));
+  return (int64_t) RF64(*(long long *)(crsl+offset));
 }
 
 /* store 64-bit signed at 32-bit offset */
 //#define putgr64s(offset, val) *(long long *)(crsl+(offset)) = (val)
 static inline void putgr64s(int offset, int64_t val) {  \
-  *(long long *)(crsl+offset) = swap64(val); \
+  *(long long *)(crsl+offset) = RF64(val); \
 }
 
 /* fetch 64-bit unsigned at 32-bit offset */
@@ -415,12 +447,12 @@ static inline void putgr64s(int offset, int64_t val) {  \
 
 /* get 32-bit unsigned at 32-bit absolute register file address */
 static inline uint32_t getar32(int offset) {  \
-  return swap32(regs.u32[offset]);  \
+  return regs.u32[offset];  \
 }
 
 /* put 32-bit unsigned at 32-bit absolute register file address */
 static inline void putar32(int offset, uint32_t val) {  \
-  regs.u32[(offset)] = swap32(val); \
+  regs.u32[(offset)] = val; \
 }
 
 /* fetch 32-bit unsigned at FP register 0 or 1
@@ -432,21 +464,21 @@ static inline void putar32(int offset, uint32_t val) {  \
 /* fetch 64-bit unsigned at FP register 0 or 1
    For FP 0, offset=0; for FP 1, offset=2 */
 static inline uint64_t getfr64(int offset) {  \
-  return (uint64_t) swap64(*(unsigned long long *)(crsl+FAC0+offset));
+  return (uint64_t) RF64(*(unsigned long long *)(crsl+FAC0+offset));
 }
 
 /* put 64-bit double in FP reg 0 or 1
    For FP 0, offset=0; for FP 1, offset=2 */
 //#define putfr64(offset, val) 
 static inline void putfr64(int offset, unsigned long long val) {  \
-  *(unsigned long long *)(crsl+FAC0+offset) = swap64((val));
+  *(unsigned long long *)(crsl+FAC0+offset) = RF64((val));
 }
 
 /* put 64-bit double in FP reg 0 or 1
    For FP 0, offset=0; for FP 1, offset=2 */
 //#define putfr64d(offset, val) *(double *)(crsl+FAC0+offset) = (val)
 static inline void putfr64d(int offset, double val) {  \
-  *(unsigned long long *)(crsl+FAC0+offset) = swap64(*(uint64_t *)&val);	  \
+  *(unsigned long long *)(crsl+FAC0+offset) = RF64(*(uint64_t *)&val);	  \
 }
 
 #define PCBLEV 0